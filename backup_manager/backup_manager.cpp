@@ -0,0 +1,498 @@
+/* C Includes */
+#include <string.h>
+#include <stdio.h>
+
+/* Pico SDK Includes */
+#include "pico/stdlib.h"
+#include "pico/stdio_usb.h"
+
+/* Project Includes */
+#include "backup_manager.h"
+#include "storage_image.h"
+
+static_assert((StorageEeprom::TOTAL_BYTES % BACKUP_CHUNK_SIZE) == 0, "Image is streamed in whole chunks");
+static_assert((BACKUP_CHUNK_SIZE % StorageEeprom::PAGE_SIZE) == 0, "Chunks cover whole EEPROM pages");
+
+void BackupManager::initialise(StorageManager *pStorageManager, StateManager *pStateManager)
+{
+    #ifdef DEBUG
+    printf("Init Backup Manager\n");
+    #endif
+
+    this->pStorageManager = pStorageManager;
+    this->pStateManager = pStateManager;
+
+    rx_count = 0;
+    rx_start_us = 0;
+    restore_active = false;
+    restore_expected = 0;
+    restore_nak_sent = false;
+    records_restored = 0;
+    records_rejected = 0;
+    send_active = false;
+    send_offset = 0;
+    send_crc = 0xFFFF;
+    session_active = false;
+    session_last_us = 0;
+}
+
+/****************************************************************
+Function:   service
+Arguments:  none
+Return:     void
+
+Called from the main loop. Drains everything the host has sent so
+far and handles each frame as it completes. While the host keeps 
+streaming the loop keeps reading, so a restore runs at USB speed 
+rather than one buffer per pass of the main loop. A backup in 
+progress sends its next chunk.
+****************************************************************/
+void BackupManager::service(void)
+{
+    char buffer[64];
+    int count;
+
+    /* A host which went away mid-frame must not leave the parser stuck */
+    if((rx_count > 0) && ((time_us_64() - rx_start_us) > (BACKUP_FRAME_TIMEOUT_MS * 1000)))
+    {
+        rx_count = 0;
+    }
+
+    while((count = stdio_usb.in_chars(buffer, sizeof(buffer))) > 0)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            receive_byte((uint8_t)buffer[i]);
+        }
+    }
+
+    if(send_active)
+    {
+        send_image_chunk();
+    }
+    else if(session_active && ((time_us_64() - session_last_us) > (BACKUP_SESSION_TIMEOUT_MS * 1000)))
+    {
+        close_session();
+    }
+}
+
+/* Holds storage writes back from the first frame of a session, and keeps printf off the link the frames share */
+void BackupManager::open_session(void)
+{
+    session_last_us = time_us_64();
+
+    if(!session_active)
+    {
+        session_active = true;
+        pStorageManager->hold_flush(true);
+        stdio_set_driver_enabled(&stdio_usb, false);
+    }
+}
+
+/* Ends a session, an unfinished image restore is abandoned and any restored records are left to the idle flush */
+void BackupManager::close_session(void)
+{
+    stdio_set_driver_enabled(&stdio_usb, true);
+
+    #ifdef DEBUG
+    if(records_restored || records_rejected)
+    {
+        printf("BackupManager::close_session() - Timed out, %d records restored without an END\n", records_restored);
+    }
+    #endif
+
+    session_active = false;
+    restore_active = false;
+    records_restored = 0;
+    records_rejected = 0;
+    pStorageManager->hold_flush(false);
+}
+
+/****************************************************************
+Function:   receive_byte
+Arguments:  (uint8_t) byte
+Return:     void
+
+Feeds one byte to the frame parser. A frame rejected for its length
+or CRC may have started on a stray sync byte, swallowing the start
+of a real frame, so everything after its sync byte is fed back 
+through the parser rather than dropped. The parser only ever writes
+at or behind the byte being replayed, so rx_frame is replayed in 
+place.
+****************************************************************/
+void BackupManager::receive_byte(uint8_t byte)
+{
+    uint16_t count;
+    uint16_t next;
+    uint16_t i;
+
+    if(parse_byte(byte) != FRAME_REJECTED)
+    {
+        return;
+    }
+
+    count = rx_count;
+
+    while(true)
+    {
+        for(next = 1; (next < count) && (rx_frame[next] != BACKUP_SYNC); next++);
+
+        rx_count = 0;
+
+        if(next >= count)
+        {
+            return;
+        }
+
+        count -= next;
+        memmove(rx_frame, &rx_frame[next], count);
+
+        for(i = 0; i < count; i++)
+        {
+            if(parse_byte(rx_frame[i]) == FRAME_REJECTED)
+            {
+                break;
+            }
+        }
+
+        if(i == count)
+        {
+            return;
+        }
+
+        /* Rejected again, rescan that frame followed by the bytes not yet replayed */
+        memmove(&rx_frame[rx_count], &rx_frame[i + 1], count - i - 1);
+        count = rx_count + (count - i - 1);
+    }
+}
+
+/* Frame parser, a byte at a time. A rejected frame is left in rx_frame, rx_count bytes long, for receive_byte() to rescan */
+FRAME_STATE BackupManager::parse_byte(uint8_t byte)
+{
+    uint16_t length;
+    uint16_t crc;
+
+    if(rx_count == 0)
+    {
+        if(byte != BACKUP_SYNC)
+        {
+            return FRAME_PENDING;
+        }
+        rx_start_us = time_us_64();
+    }
+
+    rx_frame[rx_count++] = byte;
+
+    if(rx_count < BACKUP_HEADER_SIZE)
+    {
+        return FRAME_PENDING;
+    }
+
+    length = (rx_frame[BACKUP_LENGTH_OFFSET] << 8) | rx_frame[BACKUP_LENGTH_OFFSET + 1];
+
+    if(length > BACKUP_MAX_PAYLOAD)
+    {
+        return FRAME_REJECTED;
+    }
+
+    if(rx_count < (BACKUP_HEADER_SIZE + length + BACKUP_CRC_SIZE))
+    {
+        return FRAME_PENDING;
+    }
+
+    crc = crc16(&rx_frame[BACKUP_COMMAND_OFFSET], BACKUP_HEADER_SIZE - BACKUP_COMMAND_OFFSET + length);
+
+    if((rx_frame[BACKUP_HEADER_SIZE + length]     != (uint8_t)(crc >> 8)) ||
+       (rx_frame[BACKUP_HEADER_SIZE + length + 1] != (uint8_t)crc))
+    {
+        #ifdef DEBUG
+        printf("BackupManager::parse_byte() - Frame %02x failed CRC\n", rx_frame[BACKUP_COMMAND_OFFSET]);
+        #endif
+        return FRAME_REJECTED;
+    }
+
+    rx_count = 0;
+    handle_frame(rx_frame[BACKUP_COMMAND_OFFSET], &rx_frame[BACKUP_HEADER_SIZE], length);
+    return FRAME_HANDLED;
+}
+
+void BackupManager::handle_frame(uint8_t command, const uint8_t *payload, uint16_t length)
+{
+    BACKUP_STATUS status = BACKUP_OK;
+
+    open_session();
+
+    switch(command)
+    {
+        case BACKUP_CMD_READ_IMAGE:
+            send_image();
+            break;
+
+        case BACKUP_CMD_READ_BANKS:
+            if(length != 2)
+            {
+                send_ack(command, BACKUP_ERROR_COMMAND);
+                break;
+            }
+            send_banks(payload[0], payload[1]);
+            break;
+
+        case BACKUP_CMD_WRITE_IMAGE_BEGIN:
+            send_active = false;
+
+            if((length != 4) || ((((uint32_t)payload[0] << 24) | (payload[1] << 16) | (payload[2] << 8) | payload[3]) != StorageEeprom::TOTAL_BYTES))
+            {
+                send_ack(command, BACKUP_ERROR_REJECTED);
+                break;
+            }
+            restore_active = true;
+            restore_expected = 0;
+            restore_nak_sent = false;
+            send_ack(command, BACKUP_OK);
+            break;
+
+        case BACKUP_CMD_WRITE_IMAGE_DATA:
+            write_image_data(payload, length);
+            break;
+
+        case BACKUP_CMD_WRITE_IMAGE_END:
+            send_ack(command, finish_image_restore(payload, length));
+            break;
+
+        /* Records go straight into the write-back cache, the held flush keeps them there until the END */
+        case BACKUP_CMD_WRITE_RECORD:
+            if(pStorageManager->restore_record(payload, length))
+            {
+                records_rejected++;
+            }
+            else
+            {
+                records_restored++;
+            }
+            break;
+
+        case BACKUP_CMD_WRITE_RECORDS_END:
+            #ifdef DEBUG
+            printf("BackupManager::handle_frame() - %d records restored, %d rejected\n", records_restored, records_rejected);
+            #endif
+
+            if(records_rejected)
+            {
+                status = BACKUP_ERROR_REJECTED;
+            }
+
+            if(pStorageManager->flush())
+            {
+                status = BACKUP_ERROR_STORAGE;
+            }
+
+            records_restored = 0;
+            records_rejected = 0;
+            reload_state();
+            send_ack(command, status);
+            break;
+
+        default:
+            send_ack(command, BACKUP_ERROR_COMMAND);
+            break;
+    }
+}
+
+/* Starts a backup of the RAM image, which already includes any changes still waiting to be flushed. The image is 
+copied so that saves made while it streams cannot tear it, and a restore in progress is abandoned for the buffer */
+void BackupManager::send_image(void)
+{
+    const uint8_t *image = pStorageManager->get_image();
+    uint8_t header[5];
+
+    if(image == nullptr)
+    {
+        send_ack(BACKUP_CMD_READ_IMAGE, BACKUP_ERROR_STORAGE);
+        return;
+    }
+
+    memcpy(image_buffer, image, StorageEeprom::TOTAL_BYTES);
+    restore_active = false;
+
+    header[0] = (uint8_t)(StorageEeprom::TOTAL_BYTES >> 24);
+    header[1] = (uint8_t)(StorageEeprom::TOTAL_BYTES >> 16);
+    header[2] = (uint8_t)(StorageEeprom::TOTAL_BYTES >> 8);
+    header[3] = (uint8_t)StorageEeprom::TOTAL_BYTES;
+    header[4] = image[SCHEMA_LAYOUT_VERSION.address];
+    send_frame(BACKUP_RSP_IMAGE_BEGIN, header, 5, nullptr, 0);
+
+    send_active = true;
+    send_offset = 0;
+    send_crc = 0xFFFF;
+}
+
+/* Sends the next chunk of a backup, and the END frame after the last */
+void BackupManager::send_image_chunk(void)
+{
+    uint8_t header[2];
+
+    header[0] = (uint8_t)(send_offset >> 8);
+    header[1] = (uint8_t)send_offset;
+    send_frame(BACKUP_RSP_IMAGE_DATA, header, 2, &image_buffer[send_offset], BACKUP_CHUNK_SIZE);
+
+    send_crc = crc16(&image_buffer[send_offset], BACKUP_CHUNK_SIZE, send_crc);
+    send_offset += BACKUP_CHUNK_SIZE;
+
+    if(send_offset == StorageEeprom::TOTAL_BYTES)
+    {
+        header[0] = (uint8_t)(send_crc >> 8);
+        header[1] = (uint8_t)send_crc;
+        send_frame(BACKUP_RSP_IMAGE_END, header, 2, nullptr, 0);
+        send_active = false;
+    }
+}
+
+/* Streams the record of every patch in the given banks which has one */
+void BackupManager::send_banks(uint8_t first_bank, uint8_t bank_count)
+{
+    const uint8_t *record;
+    uint8_t sent = 0;
+
+    for(uint16_t bank = first_bank; (bank < (first_bank + bank_count)) && (bank < STORAGE_MAX_BANKS); bank++)
+    {
+        for(uint8_t patch = 0; patch < NUM_PATCHES; patch++)
+        {
+            record = pStorageManager->patch_record(bank, patch);
+
+            if(record != nullptr)
+            {
+                send_frame(BACKUP_RSP_RECORD, nullptr, 0, record, record[RECORD_LENGTH_OFFSET]);
+                sent++;
+            }
+        }
+    }
+
+    send_frame(BACKUP_RSP_RECORDS_END, &sent, 1, nullptr, 0);
+}
+
+/* Collects one chunk of an image restore. A gap is answered with a single NAK, chunks are then dropped until the host resumes from the offset given */
+void BackupManager::write_image_data(const uint8_t *payload, uint16_t length)
+{
+    uint8_t nak[3];
+    uint16_t offset;
+
+    if(!restore_active || (length < 2))
+    {
+        send_ack(BACKUP_CMD_WRITE_IMAGE_DATA, BACKUP_ERROR_SEQUENCE);
+        return;
+    }
+
+    offset = (payload[0] << 8) | payload[1];
+    length -= 2;
+
+    if((offset != restore_expected) || ((offset + length) > StorageEeprom::TOTAL_BYTES))
+    {
+        if(!restore_nak_sent)
+        {
+            nak[0] = BACKUP_CMD_WRITE_IMAGE_DATA;
+            nak[1] = (uint8_t)(restore_expected >> 8);
+            nak[2] = (uint8_t)restore_expected;
+            send_frame(BACKUP_RSP_NAK, nak, 3, nullptr, 0);
+            restore_nak_sent = true;
+        }
+        return;
+    }
+
+    memcpy(&image_buffer[offset], &payload[2], length);
+    restore_expected += length;
+    restore_nak_sent = false;
+}
+
+/****************************************************************
+Function:   finish_image_restore
+Arguments:  (const uint8_t*) payload
+            (uint16_t) length
+Return:     BACKUP_STATUS
+
+Checks the received image is complete and matches the host's CRC,
+then hands it to the storage manager. Only pages which differ from
+the current contents are staged, so the flush writes each changed
+page once and restore time is bound by the EEPROM page writes.
+****************************************************************/
+BACKUP_STATUS BackupManager::finish_image_restore(const uint8_t *payload, uint16_t length)
+{
+    uint16_t crc = 0xFFFF;
+
+    if(!restore_active)
+    {
+        return BACKUP_ERROR_SEQUENCE;
+    }
+
+    restore_active = false;
+
+    if((restore_expected != StorageEeprom::TOTAL_BYTES) || (length != 2))
+    {
+        return BACKUP_ERROR_SEQUENCE;
+    }
+
+    for(uint32_t offset = 0; offset < StorageEeprom::TOTAL_BYTES; offset += BACKUP_CHUNK_SIZE)
+    {
+        crc = crc16(&image_buffer[offset], BACKUP_CHUNK_SIZE, crc);
+    }
+
+    if((payload[0] != (uint8_t)(crc >> 8)) || (payload[1] != (uint8_t)crc))
+    {
+        return BACKUP_ERROR_CRC;
+    }
+
+    if(pStorageManager->restore_image(image_buffer))
+    {
+        return BACKUP_ERROR_REJECTED;
+    }
+
+    if(pStorageManager->flush())
+    {
+        reload_state();
+        return BACKUP_ERROR_STORAGE;
+    }
+
+    reload_state();
+    return BACKUP_OK;
+}
+
+/* Restored presets replace whatever the bank cache holds */
+void BackupManager::reload_state(void)
+{
+    pStateManager->invalidate_bank_cache();
+    pStateManager->load_memory_store();
+}
+
+void BackupManager::send_ack(uint8_t command, BACKUP_STATUS status)
+{
+    uint8_t ack[2] = {command, (uint8_t)status};
+
+    send_frame(BACKUP_RSP_ACK, ack, 2, nullptr, 0);
+}
+
+/* Builds a frame from a short header and a data block, and sends it in one write to the USB driver */
+void BackupManager::send_frame(uint8_t command, const uint8_t *header, uint8_t header_length, const uint8_t *data, uint16_t data_length)
+{
+    uint16_t length = header_length + data_length;
+    uint16_t crc;
+
+    tx_frame[0]                        = BACKUP_SYNC;
+    tx_frame[BACKUP_COMMAND_OFFSET]    = command;
+    tx_frame[BACKUP_LENGTH_OFFSET]     = (uint8_t)(length >> 8);
+    tx_frame[BACKUP_LENGTH_OFFSET + 1] = (uint8_t)length;
+
+    if(header_length)
+    {
+        memcpy(&tx_frame[BACKUP_HEADER_SIZE], header, header_length);
+    }
+
+    if(data_length)
+    {
+        memcpy(&tx_frame[BACKUP_HEADER_SIZE + header_length], data, data_length);
+    }
+
+    crc = crc16(&tx_frame[BACKUP_COMMAND_OFFSET], BACKUP_HEADER_SIZE - BACKUP_COMMAND_OFFSET + length);
+    tx_frame[BACKUP_HEADER_SIZE + length]     = (uint8_t)(crc >> 8);
+    tx_frame[BACKUP_HEADER_SIZE + length + 1] = (uint8_t)crc;
+
+    stdio_usb.out_chars((const char *)tx_frame, BACKUP_HEADER_SIZE + length + BACKUP_CRC_SIZE);
+}
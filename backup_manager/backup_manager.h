@@ -0,0 +1,161 @@
+#ifndef BACKUP_MANAGER_H
+#define BACKUP_MANAGER_H
+
+/* C/C++ Includes */
+
+/* Pico SDK Includes */
+#include "pico/stdlib.h"
+
+/* Project Includes */
+#include "gpio_defs.h"
+#include "storage_manager.h"
+#include "state_manager.h"
+
+/****************************************************************
+Preset backup/restore protocol on the USB serial link.
+
+Every frame, in both directions, is:
+    BACKUP_SYNC, command, payload length (2 bytes, MSB first), 
+    payload, CRC16 of command to the end of the payload (MSB first)
+Bytes outside a frame are ignored, so debug text from the device
+can share the link. The device stops printing to the link for the 
+length of a session (below), outside one a host must skip any text
+between frames. A frame failing its length or CRC check is 
+rescanned from the byte after its sync byte, so a stray sync byte
+never costs the frame behind it. Multi byte fields are MSB first throughout.
+
+The image is sent one IMAGE_DATA frame per pass of the main loop.
+Both the image and the records cover the NUM_BANKS EEPROM banks, 
+the flash library is not backed up over this link.
+
+Backup, host -> device:
+    READ_IMAGE             -
+    READ_BANKS             first bank, bank count (EEPROM banks only)
+Device -> host:
+    IMAGE_BEGIN            total bytes (4), layout version
+    IMAGE_DATA             offset (2), up to BACKUP_CHUNK_SIZE bytes
+    IMAGE_END              CRC16 of the whole image
+    RECORD                 one variable length patch record
+    RECORDS_END            number of records sent
+
+Restore, host -> device:
+    WRITE_IMAGE_BEGIN      total bytes (4)
+    WRITE_IMAGE_DATA       offset (2), up to BACKUP_CHUNK_SIZE bytes
+    WRITE_IMAGE_END        CRC16 of the whole image
+    WRITE_RECORD           one variable length patch record
+    WRITE_RECORDS_END      -
+Data and record frames are streamed without waiting for an ACK, 
+USB flow control keeps the host from overrunning the device. Out 
+of order data is answered with one NAK carrying the next expected 
+offset, the host resumes from there. Every other command is 
+answered with an ACK carrying the command and a BACKUP_STATUS.
+
+A session opens with the first frame and closes once no frame has
+arrived for BACKUP_SESSION_TIMEOUT_MS and no backup is streaming. 
+While it is open the storage manager's idle flush and queued saves
+are held, so nothing is written to the EEPROM until an END frame 
+checks out. A record the heap has no room for is rejected, the heap
+is compacted from idle once the session closes and the record can
+then be sent again. Records are staged as they arrive: if the host
+goes away before WRITE_RECORDS_END, the session times out and the 
+records received so far are written as a partial restore.
+****************************************************************/
+#define BACKUP_SYNC              0xF5
+#define BACKUP_COMMAND_OFFSET    1
+#define BACKUP_LENGTH_OFFSET     2
+#define BACKUP_HEADER_SIZE       4
+#define BACKUP_CRC_SIZE          2
+#define BACKUP_CHUNK_SIZE        256
+#define BACKUP_MAX_PAYLOAD       (BACKUP_CHUNK_SIZE + 2)
+#define BACKUP_FRAME_TIMEOUT_MS  500   // a partial frame older than this is dropped
+#define BACKUP_SESSION_TIMEOUT_MS 2000 // a session ends this long after the last frame
+
+/* Host -> device */
+#define BACKUP_CMD_READ_IMAGE          0x01
+#define BACKUP_CMD_READ_BANKS          0x02
+#define BACKUP_CMD_WRITE_IMAGE_BEGIN   0x03
+#define BACKUP_CMD_WRITE_IMAGE_DATA    0x04
+#define BACKUP_CMD_WRITE_IMAGE_END     0x05
+#define BACKUP_CMD_WRITE_RECORD        0x06
+#define BACKUP_CMD_WRITE_RECORDS_END   0x07
+
+/* Device -> host */
+#define BACKUP_RSP_IMAGE_BEGIN         0x81
+#define BACKUP_RSP_IMAGE_DATA          0x82
+#define BACKUP_RSP_IMAGE_END           0x83
+#define BACKUP_RSP_RECORD              0x84
+#define BACKUP_RSP_RECORDS_END         0x85
+#define BACKUP_RSP_ACK                 0x86
+#define BACKUP_RSP_NAK                 0x87
+
+typedef enum backup_status
+{
+    BACKUP_OK,
+    BACKUP_ERROR_COMMAND,     // unknown command or malformed payload
+    BACKUP_ERROR_SEQUENCE,    // data without a BEGIN, or missing data at the END
+    BACKUP_ERROR_CRC,         // whole image CRC mismatch
+    BACKUP_ERROR_REJECTED,    // image or record failed validation
+    BACKUP_ERROR_STORAGE      // EEPROM write failed
+} BACKUP_STATUS;
+
+/* Outcome of feeding a byte to the frame parser */
+typedef enum frame_state
+{
+    FRAME_PENDING,
+    FRAME_HANDLED,
+    FRAME_REJECTED
+} FRAME_STATE;
+
+class BackupManager
+{
+    private:
+        StorageManager *pStorageManager;
+        StateManager *pStateManager;
+
+        /* Frame being received */
+        uint8_t rx_frame[BACKUP_HEADER_SIZE + BACKUP_MAX_PAYLOAD + BACKUP_CRC_SIZE];
+        uint16_t rx_count;
+        uint64_t rx_start_us;
+
+        uint8_t tx_frame[BACKUP_HEADER_SIZE + BACKUP_MAX_PAYLOAD + BACKUP_CRC_SIZE];
+
+        /* Image being sent or received, a backup and a restore never run at once. A restore 
+        reaches the storage manager only once the whole image is in and checked */
+        uint8_t image_buffer[StorageEeprom::TOTAL_BYTES];
+        bool restore_active;
+        uint32_t restore_expected;
+        bool restore_nak_sent;
+        uint8_t records_restored;
+        uint8_t records_rejected;
+
+        /* Session open, and the time of its last frame */
+        bool session_active;
+        uint64_t session_last_us;
+
+        /* Image backup in progress: next offset to send and the running CRC */
+        bool send_active;
+        uint32_t send_offset;
+        uint16_t send_crc;
+
+        void open_session(void);
+        void close_session(void);
+        void receive_byte(uint8_t byte);
+        FRAME_STATE parse_byte(uint8_t byte);
+        void handle_frame(uint8_t command, const uint8_t *payload, uint16_t length);
+        void send_frame(uint8_t command, const uint8_t *header, uint8_t header_length, const uint8_t *data, uint16_t data_length);
+        void send_ack(uint8_t command, BACKUP_STATUS status);
+
+        void send_image(void);
+        void send_image_chunk(void);
+        void send_banks(uint8_t first_bank, uint8_t bank_count);
+        void write_image_data(const uint8_t *payload, uint16_t length);
+        BACKUP_STATUS finish_image_restore(const uint8_t *payload, uint16_t length);
+        void reload_state(void);
+
+    public:
+        BackupManager(){};
+        void initialise(StorageManager *pStorageManager, StateManager *pStateManager);
+        void service(void);
+};
+
+#endif
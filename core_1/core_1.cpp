@@ -5,27 +5,41 @@
 /* Pico SDK Includes */
 #include "pico/multicore.h"
 #include "pico/util/queue.h"
+#include "pico/time.h"
 
 /* Project Includes */
 #include "core_1.h"
 #include "gpio_defs.h"
 #include "MCP23017.H"
+#include "input_handler.h"
+#include "debug.h"
 
 
 MCP23017 *input_port;
 MCP23017 *output_port;
+InputHandler *input_handler;
 
 queue_t* core_1_queue_rx;
 queue_t* core_1_queue_tx;
 
 QUEUE_ITEM_X queue_store;
 
-uint8_t port_value = 0;
+/* Port interrupts waiting to be serviced, and debounce ticks from this core's own alarm pool */
+queue_t input_event_queue;
+alarm_pool_t *core_1_alarm_pool;
+repeating_timer_t debounce_timer;
+volatile bool debounce_tick;
 
 void port_interrupt_callback(uint32_t gpio, uint32_t events);
+bool debounce_timer_callback(repeating_timer_t *timer);
+void service_input_events(void);
 
 void core_1_main(void)
 {
+#ifdef DEBUG
+    stack_paint();
+#endif
+
     i2c_init(i2c0, 400000);
 
 #ifdef DEBUG
@@ -42,38 +56,59 @@ void core_1_main(void)
     gpio_set_dir(PORTA_INTERRUPT, GPIO_IN);
     gpio_set_dir(PORTB_INTERRUPT, GPIO_IN);
 
+    queue_init(&input_event_queue, sizeof(INPUT_EVENT_X), INPUT_EVENT_QUEUE_LENGTH);
+    debounce_tick = false;
+
     gpio_set_irq_enabled_with_callback(PORTA_INTERRUPT, GPIO_IRQ_EDGE_FALL, true, (gpio_irq_callback_t)port_interrupt_callback);
     gpio_set_irq_enabled(PORTB_INTERRUPT, GPIO_IRQ_EDGE_FALL, true);
 
     /* Port Configurations */
     input_port = new MCP23017(i2c0, 0x21);
 
-    input_port->set_port_mode(0);
-    input_port->set_ioconfig(0b00101000);
+    /* 16 bit addressing with sequential operation, so INTF, INTCAP and GPIO of both ports can be read in one burst */
+    input_port->set_port_mode(MODE16BIT);
+    input_port->set_ioconfig(0b00001000);
     input_port->set_iodir_a(0xFF);
     input_port->set_iodir_b(0xFF);
     input_port->set_gppu_a (0xFF);
     input_port->set_gppu_b (0xFF);
     input_port->set_ipol_a (0xFF);
     input_port->set_ipol_b (0xFF);
-    input_port->set_intcon_a(0xFF);
-    input_port->set_intcon_b(0xFF);
+    input_port->set_gpint_a(0xFF);
+    input_port->set_gpint_b(0xFF);
+    input_port->set_intcon_a(0x00);
+    input_port->set_intcon_b(0x00);
     input_port->write_configuration();
 
     output_port = new MCP23017(i2c0, 0x20);
 
-    output_port->set_port_mode(0);
-    output_port->set_ioconfig(0b00111000);
+    output_port->set_port_mode(MODE16BIT);
+    output_port->set_ioconfig(0b00011000);
     output_port->set_iodir_a(0x00);
     output_port->set_iodir_b(0x00);
     output_port->write_configuration();
 
-    /* Tx/Rx Queue */
-    core_1_queue_rx = (queue_t *)multicore_fifo_pop_blocking();
+    /* Tx/Rx Queue: core 0 sends its receive queue first, which is this core's transmit queue */
     core_1_queue_tx = (queue_t *)multicore_fifo_pop_blocking();
+    core_1_queue_rx = (queue_t *)multicore_fifo_pop_blocking();
+
+    /* Let core 0 pause this core while it writes the flash library. The lockout handler takes 
+    over the FIFO, so this must come after the queue pointers have been received */
+    multicore_lockout_victim_init();
+
+    input_handler = new InputHandler;
+    input_handler->initialise(input_port, core_1_queue_tx);
+    input_handler->set_leading_edge(PORTA, LEADING_EDGE_MASK_A, DEBOUNCE_LOCKOUT_MS);
+    input_handler->set_leading_edge(PORTB, LEADING_EDGE_MASK_B, DEBOUNCE_LOCKOUT_MS);
+
+    /* An alarm pool created here fires its callbacks on this core */
+    core_1_alarm_pool = alarm_pool_create(DEBOUNCE_HARDWARE_ALARM, 1);
+    alarm_pool_add_repeating_timer_us(core_1_alarm_pool, -DEBOUNCE_TICK_US, debounce_timer_callback, NULL, &debounce_timer);
 
     while(1)
     {
+        service_input_events();
+
         if(queue_try_remove(core_1_queue_rx, &queue_store))
         {
             // do something with the payload
@@ -85,32 +120,54 @@ void core_1_main(void)
     }
 }
 
+/* IRQ context: only records which line fired and when, the expander is read from the core 1 loop */
 void port_interrupt_callback(uint32_t gpio, uint32_t events)
 {
-    QUEUE_ITEM_X command;
-    
-    command.instruction_code = PORT_INPUT;
+    INPUT_EVENT_X event;
 
-#ifdef DEBUG
-    printf("Detected Input\n");
-#endif
+    event.timestamp_us = time_us_32();
+    event.gpio = (uint8_t)gpio;
 
-    sleep_ms(50);
+    queue_try_add(&input_event_queue, &event);
+}
 
-    switch(gpio)
+/* IRQ context: flags the tick, sampling needs the I2C bus so it happens in the core 1 loop */
+bool debounce_timer_callback(repeating_timer_t *timer)
+{
+    debounce_tick = true;
+    return true;
+}
+
+/* Hands queued port interrupts and pending ticks to the input handler. One snapshot covers both 
+ports, so interrupts queued together are handled with one read stamped with the earliest of them */
+void service_input_events(void)
+{
+    INPUT_EVENT_X event;
+    uint32_t first_us = 0;
+    bool pending = false;
+
+    while(queue_try_remove(&input_event_queue, &event))
+    {
+        if((event.gpio != PORTA_INTERRUPT) && (event.gpio != PORTB_INTERRUPT))
+        {
+            continue;
+        }
+
+        if(!pending || ((int32_t)(event.timestamp_us - first_us) < 0))
+        {
+            first_us = event.timestamp_us;
+        }
+        pending = true;
+    }
+
+    if(pending)
     {
-        case PORTA_INTERRUPT:
-            port_value = input_port->read_input_mask(PORTA);
-            command.data[0] = PORTA;
-            break;
-        case PORTB_INTERRUPT:
-            port_value = input_port->read_input_mask(PORTB);
-            command.data[0] = PORTB;
-            break;
-        default:
-            break;
+        input_handler->port_interrupt(first_us);
     }
 
-    command.data[1] = port_value;
-    queue_try_add(core_1_queue_tx, &port_value);
-}
\ No newline at end of file
+    if(debounce_tick)
+    {
+        debounce_tick = false;
+        input_handler->tick();
+    }
+}
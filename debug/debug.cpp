@@ -2,6 +2,12 @@
 #include <stdio.h>
 #include <array>
 
+/* Stack bounds from the linker script, core 1 is launched on the stack between __StackOneBottom and __StackOneTop */
+extern uint32_t __StackBottom;
+extern uint32_t __StackTop;
+extern uint32_t __StackOneBottom;
+extern uint32_t __StackOneTop;
+
 void debug(int time)
 {
     gpio_init(25);
@@ -38,4 +44,47 @@ void print_buff(uint8_t* src, uint16_t num_bytes)
     }
     printf("\n");
     fflush(stdout);
-};
\ No newline at end of file
+};
+
+static void stack_bounds(uint32_t **bottom, uint32_t **top)
+{
+    if(get_core_num() == 0)
+    {
+        *bottom = &__StackBottom;
+        *top    = &__StackTop;
+    }
+    else
+    {
+        *bottom = &__StackOneBottom;
+        *top    = &__StackOneTop;
+    }
+}
+
+/* Fills the unused part of the calling core's stack with STACK_PAINT_WORD, leaving a margin below this frame */
+void stack_paint(void)
+{
+    uint32_t *bottom;
+    uint32_t *top;
+    uint32_t *current = (uint32_t*)__builtin_frame_address(0);
+
+    stack_bounds(&bottom, &top);
+
+    for(uint32_t *word = bottom; word < (current - 16); word++)
+    {
+        *word = STACK_PAINT_WORD;
+    }
+}
+
+/* Returns the most stack, in bytes, the calling core has used since stack_paint() */
+uint32_t stack_high_water(void)
+{
+    uint32_t *bottom;
+    uint32_t *top;
+    uint32_t *word;
+
+    stack_bounds(&bottom, &top);
+
+    for(word = bottom; (word < top) && (*word == STACK_PAINT_WORD); word++);
+
+    return (uint32_t)(top - word) * sizeof(uint32_t);
+}
\ No newline at end of file
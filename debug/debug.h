@@ -7,4 +7,9 @@ void debug(int time);
 void hang();
 void print_buff(uint8_t* src, uint16_t num_bytes);
 
+/* Stack usage: paint once near the top of a core's entry function, then read the deepest point reached */
+#define STACK_PAINT_WORD 0x5A5AA5A5
+void stack_paint(void);
+uint32_t stack_high_water(void);
+
 #endif
\ No newline at end of file
@@ -107,10 +107,24 @@ void DisplayManager::update_patch(uint8_t value)
     itsAlphaNumeric.write_character(value, 3);
 }
 
+/* EEPROM banks are shown as a letter, flash library banks as a number from 1 over the separator and bank characters */
 void DisplayManager::update_bank(uint8_t value)
 {
-    uint8_t bank_code = bank_lookup[value];
-    uint16_t found_value = itsAlphaNumeric.character_lookup((char)bank_code);
+    uint8_t bank_code;
+    uint16_t found_value;
+
+    if(value < NUM_BANKS)
+    {
+        bank_code = bank_lookup[value];
+    }
+    else
+    {
+        value = (value - NUM_BANKS) + 1;
+        itsAlphaNumeric.write_character('0' + (value / 10), 1);
+        bank_code = '0' + (value % 10);
+    }
+
+    found_value = itsAlphaNumeric.character_lookup((char)bank_code);
 
     found_value |= itsAlphaNumeric.character_lookup('.');
 
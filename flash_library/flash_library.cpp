@@ -0,0 +1,431 @@
+/* C Includes */
+#include <memory.h>
+#include <stdio.h>
+
+/* Pico SDK Includes */
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+
+/* Project Includes */
+#include "flash_library.h"
+#include "storage_image.h"
+
+FlashLibrary::FlashLibrary()
+{
+    memset(index, 0, sizeof(index));
+    sequence = 0;
+    write_slot = 0;
+    erased_sectors = 0;
+}
+
+/****************************************************************
+Function:   initialise
+Arguments:  none
+Return:     void
+
+Rebuilds the RAM index from the records in flash, then reclaims 
+space until FLASH_LIBRARY_RESERVE_SECTORS erased sectors lie ahead
+of the log head. Waits for core 1 to register as a lockout victim
+first, as reclaiming may erase a sector.
+****************************************************************/
+void FlashLibrary::initialise(void)
+{
+    #ifdef DEBUG
+    printf("FlashLibrary::initialise()\n");
+    #endif
+
+    /* Core 1 registers once it has its queue pointers, every flash write from here on can pause it */
+    while(!multicore_lockout_victim_is_initialized(1))
+    {
+        tight_loop_contents();
+    }
+
+    scan();
+    reclaim();
+
+    #ifdef DEBUG
+    printf(" - Sequence: %lu, write slot: %d, erased sectors: %d\n", sequence, write_slot, erased_sectors);
+    #endif
+}
+
+/* Records are read straight through XIP, no bus transactions */
+const uint8_t * FlashLibrary::slot_address(uint16_t slot)
+{
+    return (const uint8_t *)(XIP_BASE + FLASH_LIBRARY_OFFSET + ((uint32_t)slot * FLASH_RECORD_SIZE));
+}
+
+bool FlashLibrary::slot_erased(uint16_t slot)
+{
+    const uint8_t *record = slot_address(slot);
+
+    for(uint16_t i = 0; i < FLASH_RECORD_SIZE; i++)
+    {
+        if(record[i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FlashLibrary::sector_erased(uint16_t sector)
+{
+    for(uint16_t i = 0; i < FLASH_RECORDS_PER_SECTOR; i++)
+    {
+        if(!slot_erased((sector * FLASH_RECORDS_PER_SECTOR) + i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* A record torn by a reset part way through programming fails its CRC and is ignored. The payload must 
+also pass the checks an EEPROM record does, as it is decoded by the same code */
+bool FlashLibrary::record_valid(const uint8_t *record)
+{
+    uint16_t magic = (record[FLASH_RECORD_MAGIC_OFFSET] << 8) | record[FLASH_RECORD_MAGIC_OFFSET + 1];
+    uint16_t crc   = (record[FLASH_RECORD_CRC_OFFSET] << 8) | record[FLASH_RECORD_CRC_OFFSET + 1];
+
+    return (magic == FLASH_RECORD_MAGIC) && (crc == crc16(record, FLASH_RECORD_CRC_OFFSET)) &&
+           (record[FLASH_RECORD_VERSION_OFFSET] == PATCH_RECORD_VERSION) && patch_record_valid(&record[FLASH_RECORD_PAYLOAD_OFFSET]);
+}
+
+/* True if the slot holds the copy of its bank/patch the index points at */
+bool FlashLibrary::slot_live(uint16_t slot)
+{
+    const uint8_t *record = slot_address(slot);
+    uint16_t bank;
+    uint8_t patch;
+
+    if(!record_valid(record))
+    {
+        return false;
+    }
+
+    bank  = (record[FLASH_RECORD_BANK_OFFSET] << 8) | record[FLASH_RECORD_BANK_OFFSET + 1];
+    patch = record[FLASH_RECORD_PATCH_OFFSET];
+
+    return (bank < FLASH_LIBRARY_BANKS) && (patch < NUM_PATCHES) && (index[(bank * NUM_PATCHES) + patch] == (slot + 1));
+}
+
+uint32_t FlashLibrary::record_sequence(const uint8_t *record)
+{
+    const uint8_t *field = &record[FLASH_RECORD_SEQUENCE_OFFSET];
+
+    return ((uint32_t)field[0] << 24) | ((uint32_t)field[1] << 16) | ((uint32_t)field[2] << 8) | field[3];
+}
+
+/****************************************************************
+Function:   scan
+Arguments:  none
+Return:     void
+
+Walks every slot once. The newest record of each bank/patch goes 
+in the index, and the log head follows the newest record overall.
+****************************************************************/
+void FlashLibrary::scan(void)
+{
+    const uint8_t *record;
+    uint32_t record_seq;
+    uint16_t bank;
+    uint16_t key;
+    int32_t newest = -1;
+
+    memset(index, 0, sizeof(index));
+    sequence = 0;
+    erased_sectors = 0;
+
+    for(uint16_t slot = 0; slot < FLASH_LIBRARY_SLOTS; slot++)
+    {
+        record = slot_address(slot);
+        if(!record_valid(record))
+        {
+            continue;
+        }
+
+        bank = (record[FLASH_RECORD_BANK_OFFSET] << 8) | record[FLASH_RECORD_BANK_OFFSET + 1];
+        if((bank >= FLASH_LIBRARY_BANKS) || (record[FLASH_RECORD_PATCH_OFFSET] >= NUM_PATCHES))
+        {
+            continue;
+        }
+
+        record_seq = record_sequence(record);
+        key = (bank * NUM_PATCHES) + record[FLASH_RECORD_PATCH_OFFSET];
+
+        if((index[key] == 0) || (record_seq > record_sequence(slot_address(index[key] - 1))))
+        {
+            index[key] = slot + 1;
+        }
+
+        if((newest < 0) || (record_seq > sequence))
+        {
+            sequence = record_seq;
+            newest = slot;
+        }
+    }
+
+    for(uint16_t sector = 0; sector < FLASH_LIBRARY_SECTORS; sector++)
+    {
+        if(sector_erased(sector))
+        {
+            erased_sectors++;
+        }
+    }
+
+    write_slot = (newest < 0) ? 0 : ((newest + 1) % FLASH_LIBRARY_SLOTS);
+}
+
+/****************************************************************
+Function:   patch_record
+Arguments:  (uint16_t) bank
+            (uint8_t)  patch
+Return:     const uint8_t* (nullptr if the patch was never stored)
+
+Read-only view, through XIP, of the newest stored copy of a patch.
+It is a variable length record as stored on the EEPROM heap, so the
+RECORD_ offsets in gpio_defs.h apply. The key byte is unused and 
+left erased. Valid until the next write to the library.
+****************************************************************/
+const uint8_t * FlashLibrary::patch_record(uint16_t bank, uint8_t patch)
+{
+    uint16_t slot;
+
+    if((bank >= FLASH_LIBRARY_BANKS) || (patch >= NUM_PATCHES))
+    {
+        return nullptr;
+    }
+
+    slot = index[(bank * NUM_PATCHES) + patch];
+    if(slot == 0)
+    {
+        return nullptr;
+    }
+    return &slot_address(slot - 1)[FLASH_RECORD_PAYLOAD_OFFSET];
+}
+
+/****************************************************************
+Function:   write_patch
+Arguments:  (uint16_t) bank
+            (uint8_t)  patch
+            (const uint8_t*) record (sealed variable length record)
+Return:     uint8_t (0 on success)
+
+Appends a new copy of a patch at the log head with a single page 
+program, pausing core 1 for that one page. The old copy is left in
+place until its sector is reclaimed, which is left to reclaim_step()
+so no sector is ever erased here. Fails while the slots left are 
+needed to reclaim a sector, until reclaim_step() has caught up.
+****************************************************************/
+uint8_t FlashLibrary::write_patch(uint16_t bank, uint8_t patch, const uint8_t *record)
+{
+    if((bank >= FLASH_LIBRARY_BANKS) || (patch >= NUM_PATCHES) || !patch_record_valid(record))
+    {
+        return 1;
+    }
+
+    if(free_slots() <= FLASH_RECORDS_PER_SECTOR)
+    {
+        #ifdef DEBUG
+        printf("FlashLibrary::write_patch() - Erased reserve exhausted, waiting for reclaim\n");
+        #endif
+        return 1;
+    }
+    return append(bank, patch, record);
+}
+
+/* Erased slots from the log head on. A sector's worth is kept back from saves, so the live records of the oldest sector can always be moved out */
+uint16_t FlashLibrary::free_slots(void)
+{
+    return ((FLASH_RECORDS_PER_SECTOR - (write_slot % FLASH_RECORDS_PER_SECTOR)) % FLASH_RECORDS_PER_SECTOR) + (erased_sectors * FLASH_RECORDS_PER_SECTOR);
+}
+
+uint8_t FlashLibrary::append(uint16_t bank, uint8_t patch, const uint8_t *source)
+{
+    uint8_t record[FLASH_RECORD_SIZE];
+    uint16_t crc;
+
+    /* Skip slots left part programmed by a reset. A new sector must already have been erased by reclaim_step() */
+    while(true)
+    {
+        if((write_slot % FLASH_RECORDS_PER_SECTOR) == 0)
+        {
+            if(!sector_erased(write_slot / FLASH_RECORDS_PER_SECTOR))
+            {
+                #ifdef DEBUG
+                printf("FlashLibrary::append() - Sector %d not erased\n", write_slot / FLASH_RECORDS_PER_SECTOR);
+                #endif
+                return 1;
+            }
+            erased_sectors--;
+            break;
+        }
+
+        if(slot_erased(write_slot))
+        {
+            break;
+        }
+        write_slot = (write_slot + 1) % FLASH_LIBRARY_SLOTS;
+    }
+
+    sequence++;
+
+    memset(record, 0xFF, FLASH_RECORD_SIZE);
+    record[FLASH_RECORD_MAGIC_OFFSET]        = (uint8_t)(FLASH_RECORD_MAGIC >> 8);
+    record[FLASH_RECORD_MAGIC_OFFSET + 1]    = (uint8_t)FLASH_RECORD_MAGIC;
+    record[FLASH_RECORD_SEQUENCE_OFFSET]     = (uint8_t)(sequence >> 24);
+    record[FLASH_RECORD_SEQUENCE_OFFSET + 1] = (uint8_t)(sequence >> 16);
+    record[FLASH_RECORD_SEQUENCE_OFFSET + 2] = (uint8_t)(sequence >> 8);
+    record[FLASH_RECORD_SEQUENCE_OFFSET + 3] = (uint8_t)sequence;
+    record[FLASH_RECORD_BANK_OFFSET]         = (uint8_t)(bank >> 8);
+    record[FLASH_RECORD_BANK_OFFSET + 1]     = (uint8_t)bank;
+    record[FLASH_RECORD_PATCH_OFFSET]        = patch;
+    record[FLASH_RECORD_VERSION_OFFSET]      = PATCH_RECORD_VERSION;
+    memcpy(&record[FLASH_RECORD_PAYLOAD_OFFSET], source, source[RECORD_LENGTH_OFFSET]);
+    record[FLASH_RECORD_PAYLOAD_OFFSET + RECORD_KEY_OFFSET] = 0xFF;
+
+    crc = crc16(record, FLASH_RECORD_CRC_OFFSET);
+    record[FLASH_RECORD_CRC_OFFSET]     = (uint8_t)(crc >> 8);
+    record[FLASH_RECORD_CRC_OFFSET + 1] = (uint8_t)crc;
+
+    program_slot(write_slot, record);
+
+    if(!record_valid(slot_address(write_slot)))
+    {
+        #ifdef DEBUG
+        printf("FlashLibrary::append() - Slot %d failed verification\n", write_slot);
+        #endif
+        write_slot = (write_slot + 1) % FLASH_LIBRARY_SLOTS;
+        return 1;
+    }
+
+    index[(bank * NUM_PATCHES) + patch] = write_slot + 1;
+    write_slot = (write_slot + 1) % FLASH_LIBRARY_SLOTS;
+
+    return 0;
+}
+
+/* Reclaims until the erased reserve is restored, only at boot as it may erase several sectors back to back */
+void FlashLibrary::reclaim(void)
+{
+    while(reclaim_step())
+    {
+    }
+}
+
+/****************************************************************
+Function:   reclaim_step
+Arguments:  none
+Return:     bool (false if the reserve is full or no progress can
+            be made)
+
+One step towards FLASH_LIBRARY_RESERVE_SECTORS erased sectors ahead
+of the log head: copy one live record out of the oldest sector to 
+the head, or erase that sector once nothing in it is live. A step 
+is one page program or one sector erase, and the erase pauses core
+1 for tens of milliseconds, so it is run from idle time.
+****************************************************************/
+bool FlashLibrary::reclaim_step(void)
+{
+    const uint8_t *record;
+    uint16_t head_sector;
+    uint16_t sector;
+    uint16_t slot;
+
+    if(erased_sectors >= FLASH_LIBRARY_RESERVE_SECTORS)
+    {
+        return false;
+    }
+
+    /* The oldest sector is the first one in use after the sector the head is in */
+    head_sector = ((write_slot + FLASH_LIBRARY_SLOTS - 1) % FLASH_LIBRARY_SLOTS) / FLASH_RECORDS_PER_SECTOR;
+    sector = (head_sector + 1) % FLASH_LIBRARY_SECTORS;
+
+    while((sector != head_sector) && sector_erased(sector))
+    {
+        sector = (sector + 1) % FLASH_LIBRARY_SECTORS;
+    }
+
+    if(sector == head_sector)
+    {
+        return false;
+    }
+
+    for(uint8_t i = 0; i < FLASH_RECORDS_PER_SECTOR; i++)
+    {
+        slot = (sector * FLASH_RECORDS_PER_SECTOR) + i;
+
+        if(slot_live(slot))
+        {
+            record = slot_address(slot);
+            return append((record[FLASH_RECORD_BANK_OFFSET] << 8) | record[FLASH_RECORD_BANK_OFFSET + 1],
+                          record[FLASH_RECORD_PATCH_OFFSET], &record[FLASH_RECORD_PAYLOAD_OFFSET]) == 0;
+        }
+    }
+
+    erase_sector(sector);
+    return true;
+}
+
+/****************************************************************
+Function:   program_slot
+Arguments:  (uint16_t) slot
+            (const uint8_t*) record
+Return:     void
+
+Flash programs whole pages, so the record is placed in a page of 
+0xFF, which leaves the other slots sharing the page untouched. 
+Core 1 is locked out and interrupts disabled while XIP is 
+unavailable.
+****************************************************************/
+void FlashLibrary::program_slot(uint16_t slot, const uint8_t *record)
+{
+    uint32_t offset = (uint32_t)slot * FLASH_RECORD_SIZE;
+    uint32_t page_offset = offset & ~(FLASH_PAGE_SIZE - 1);
+    uint32_t interrupts;
+
+    memset(page_buffer, 0xFF, FLASH_PAGE_SIZE);
+    memcpy(&page_buffer[offset - page_offset], record, FLASH_RECORD_SIZE);
+
+    lockout_start();
+    interrupts = save_and_disable_interrupts();
+
+    flash_range_program(FLASH_LIBRARY_OFFSET + page_offset, page_buffer, FLASH_PAGE_SIZE);
+
+    restore_interrupts(interrupts);
+    lockout_end();
+}
+
+void FlashLibrary::erase_sector(uint16_t sector)
+{
+    uint32_t interrupts;
+
+    lockout_start();
+    interrupts = save_and_disable_interrupts();
+
+    flash_range_erase(FLASH_LIBRARY_OFFSET + ((uint32_t)sector * FLASH_SECTOR_SIZE), FLASH_SECTOR_SIZE);
+
+    restore_interrupts(interrupts);
+    lockout_end();
+
+    erased_sectors++;
+}
+
+/* Core 1 runs from flash too, so it is parked while XIP is unavailable. initialise() has 
+already waited for it to register as a victim */
+void FlashLibrary::lockout_start(void)
+{
+    multicore_lockout_start_blocking();
+}
+
+void FlashLibrary::lockout_end(void)
+{
+    multicore_lockout_end_blocking();
+}
+
+uint16_t FlashLibrary::get_erased_sectors(void)
+{
+    return erased_sectors;
+}
@@ -0,0 +1,77 @@
+#ifndef FLASH_LIBRARY_H
+#define FLASH_LIBRARY_H
+
+/* C/C++ Includes */
+
+/* Pico Includes */
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+
+/* Project Includes */
+#include "gpio_defs.h"
+
+/* Preset library in internal flash, log-structured over FLASH_LIBRARY_SECTORS sectors from FLASH_TARGET_OFFSET. 
+It holds FLASH_LIBRARY_BANKS banks (gpio_defs.h), numbered from 0 here and from NUM_BANKS in bank navigation */
+#define FLASH_LIBRARY_OFFSET            FLASH_TARGET_OFFSET
+#define FLASH_LIBRARY_SECTORS           64      // 256 KB
+#define FLASH_LIBRARY_RESERVE_SECTORS   2       // erased sectors kept ahead of the log head
+
+/* Each record holds one patch, several records share a program page */
+#define FLASH_RECORD_SIZE               128
+#define FLASH_RECORDS_PER_SECTOR        (FLASH_SECTOR_SIZE / FLASH_RECORD_SIZE)
+#define FLASH_LIBRARY_SLOTS             (FLASH_LIBRARY_SECTORS * FLASH_RECORDS_PER_SECTOR)
+
+/* Offsets Within a Flash Record */
+#define FLASH_RECORD_MAGIC              0x5052  // "PR", an erased slot reads 0xFFFF
+#define FLASH_RECORD_MAGIC_OFFSET       0       // 2 bytes, MSB first
+#define FLASH_RECORD_SEQUENCE_OFFSET    2       // 4 bytes, MSB first
+#define FLASH_RECORD_BANK_OFFSET        6       // 2 bytes, MSB first
+#define FLASH_RECORD_PATCH_OFFSET       8
+#define FLASH_RECORD_VERSION_OFFSET     9
+#define FLASH_RECORD_PAYLOAD_OFFSET     10      // variable length record as stored on the EEPROM heap, padded with 0xFF to PATCH_RECORD_MAX_SIZE
+#define FLASH_RECORD_CRC_OFFSET         (FLASH_RECORD_PAYLOAD_OFFSET + PATCH_RECORD_MAX_SIZE)  // CRC16 of everything before it
+#define FLASH_RECORD_CRC_SIZE           2
+
+static_assert((FLASH_RECORD_CRC_OFFSET + FLASH_RECORD_CRC_SIZE) <= FLASH_RECORD_SIZE, "Flash record overflows its slot");
+static_assert((FLASH_PAGE_SIZE % FLASH_RECORD_SIZE) == 0, "Flash records must not straddle program pages");
+static_assert((FLASH_LIBRARY_BANKS * NUM_PATCHES) <= (FLASH_LIBRARY_SLOTS - (FLASH_LIBRARY_RESERVE_SECTORS * FLASH_RECORDS_PER_SECTOR)), "Every library patch needs a slot outside the erased reserve");
+
+class FlashLibrary
+{
+    private:
+        /* Newest slot (plus one, 0 if never stored) of every bank/patch */
+        uint16_t index[FLASH_LIBRARY_BANKS * NUM_PATCHES];
+
+        uint32_t sequence;
+        uint16_t write_slot;
+        uint16_t erased_sectors;
+
+        uint8_t page_buffer[FLASH_PAGE_SIZE];
+
+        const uint8_t * slot_address(uint16_t slot);
+        bool slot_erased(uint16_t slot);
+        bool sector_erased(uint16_t sector);
+        bool record_valid(const uint8_t *record);
+        bool slot_live(uint16_t slot);
+        uint32_t record_sequence(const uint8_t *record);
+
+        void scan(void);
+        uint16_t free_slots(void);
+        uint8_t append(uint16_t bank, uint8_t patch, const uint8_t *source);
+        void reclaim(void);
+        void program_slot(uint16_t slot, const uint8_t *record);
+        void erase_sector(uint16_t sector);
+        void lockout_start(void);
+        void lockout_end(void);
+
+    public:
+        FlashLibrary();
+        void initialise(void);
+
+        const uint8_t * patch_record(uint16_t bank, uint8_t patch);
+        uint8_t write_patch(uint16_t bank, uint8_t patch, const uint8_t *record);
+        bool reclaim_step(void);
+        uint16_t get_erased_sectors(void);
+};
+
+#endif
@@ -55,6 +55,10 @@
 #define NUM_PATCHES   5
 #define TOTAL_PATCHES 25
 
+/* Banks after the first NUM_BANKS live in the flash library, the display numbers them 1-99 */
+#define FLASH_LIBRARY_BANKS 99
+#define TOTAL_BANKS         (NUM_BANKS + FLASH_LIBRARY_BANKS)
+
 /* Queue Structure */
 typedef struct queue_item_x
 {
@@ -65,6 +69,20 @@ typedef struct queue_item_x
 /* Command Decode Values */
 #define PORT_OUTPUT 0xA0
 #define PORT_INPUT  0xA1
+#define STORAGE_RESULT 0xA2
+
+/* PORT_INPUT data: one debounced press or release, with the port's pressed mask after it */
+#define INPUT_PORT_OFFSET       0
+#define INPUT_MASK_OFFSET       1
+#define INPUT_SWITCH_OFFSET     2
+#define INPUT_EDGE_OFFSET       3
+#define INPUT_TIMESTAMP_OFFSET  4   // time of the first contact edge in us, 4 bytes MSB first
+#define INPUT_MODE_OFFSET       8   // how the edge was qualified, so latency can be compared per mode
+#define INPUT_EDGE_PRESS        1
+#define INPUT_EDGE_RELEASE      0
+#define INPUT_MODE_DEBOUNCED    0
+#define INPUT_MODE_LEADING_EDGE 1
+#define INPUT_MODE_COUNT        2
 
 /* Port A */                    
 #define SW_1_MASK       0x01
@@ -161,7 +179,7 @@ typedef struct bank_data_x
     PATCH_DATA_X patch_array[NUM_PATCHES];
 } BANK_DATA_X;
 
-/* Storage Defines - Keep in case need for any "write once/read many" data e.g. graphics data... */
+/* Storage Defines - internal flash from FLASH_TARGET_OFFSET holds the preset library, see flash_library.h */
 #define FLASH_TARGET_OFFSET   262144
 #define FLASH_OFFSET          XIP_BASE + FLASH_TARGET_OFFSET
 
@@ -195,12 +213,22 @@ typedef struct bank_data_x
 #define FLAGS_OFFSET             0   // bitmask for Startup Mode, Ex Ctrl A type, Ext Ctrl B Type
 #define LAST_BANK_OFFSET         1
 #define LAST_PATCH_OFFSET        2
-#define IP_ADDRESS_OFFSET        3
-#define IP_ADDRESS_SIZE          12
-#define SYSTEM_INFO_SIZE         15 // (IP_ADDRESS_OFFSET + IP_ADDRESS_SIZE + 1)
+#define LAYOUT_VERSION_OFFSET    3   // 0 on devices formatted before the layout was versioned
+#define SYSTEM_CRC_OFFSET        4   // CRC16 of the system info bytes preceding it, MSB first
+#define SYSTEM_CRC_SIZE          2
+#define IP_ADDRESS_OFFSET        6
+#define IP_ADDRESS_SIZE          9
+#define SYSTEM_INFO_SIZE         15 // (IP_ADDRESS_OFFSET + IP_ADDRESS_SIZE)
+
+/* Storage layout versions, bump STORAGE_LAYOUT_VERSION and add an entry to storage_layouts[] when the offsets/sizes below change.
+The offsets are gathered into a compile time schema, and checked for overlap, in storage_schema.h */
+#define STORAGE_LAYOUT_LEGACY    1   // unversioned 86 byte patch records without CRC
+#define STORAGE_LAYOUT_FIXED     2   // fixed PATCH_DATA_SIZE patch records with CRC
+#define STORAGE_LAYOUT_VERSION   3   // patch index followed by a heap of variable length records
+#define PATCH_RECORD_VERSION     1
 
 #define PATCH_DATA_OFFSET (SYSTEM_INFO_OFFSET + SYSTEM_INFO_SIZE)
-/* Offsets Within Patch Data */
+/* Offsets Within a Fixed Patch Record - layouts 1 and 2, and the flash library payload */
 #define PATCH_TITLE_OFFSET 0
 #define PATCH_TITLE_SIZE 32
 
@@ -216,12 +244,102 @@ typedef struct bank_data_x
 #define PATCH_MIDI_PC_OFFSET         (PATCH_GENERAL_OFFSET + PATCH_GENERAL_SIZE)
 #define PATCH_MIDI_PC_DATA_SIZE      20
 
-#define PATCH_MIDI_CC_DATA_OFFSET    (PATCH_MIDI_PC_OFFSET)
+#define PATCH_MIDI_CC_DATA_OFFSET    (PATCH_MIDI_PC_OFFSET + PATCH_MIDI_PC_DATA_SIZE)
 #define PATCH_MIDI_CC_DATA_SIZE      30
 
-#define PATCH_DATA_SIZE              (PATCH_TITLE_SIZE + PATCH_GENERAL_SIZE + PATCH_MIDI_PC_DATA_SIZE + PATCH_MIDI_CC_DATA_SIZE)
+#define PATCH_MAX_MIDI_PC            (PATCH_MIDI_PC_DATA_SIZE / MIDI_PC_SIZE)
+#define PATCH_MAX_MIDI_CC            (PATCH_MIDI_CC_DATA_SIZE / MIDI_CC_SIZE)
+
+#define PATCH_PAYLOAD_SIZE           (PATCH_TITLE_SIZE + PATCH_GENERAL_SIZE + PATCH_MIDI_PC_DATA_SIZE + PATCH_MIDI_CC_DATA_SIZE)
+
+#define PATCH_VERSION_OFFSET         (PATCH_PAYLOAD_SIZE)
+#define PATCH_CRC_OFFSET             (PATCH_VERSION_OFFSET + 1)   // CRC16 of the payload and version byte, MSB first
+#define PATCH_CRC_SIZE               2
+
+#define PATCH_DATA_SIZE              (PATCH_CRC_OFFSET + PATCH_CRC_SIZE)
 #define BANK_DATA_SIZE               (PATCH_DATA_SIZE * NUM_PATCHES)
 
+/* Patch Index - one entry per patch (key = bank * NUM_PATCHES + patch), the EEPROM address of its record MSB first.
+Only the NUM_BANKS banks navigated ahead of the flash library are kept, so a bank number means the same bank to a host as on the display */
+#define STORAGE_MAX_BANKS            NUM_BANKS
+#define PATCH_INDEX_ENTRIES          (STORAGE_MAX_BANKS * NUM_PATCHES)
+#define PATCH_INDEX_OFFSET           32   // page 1, so page 0 holding the layout version is committed apart from it
+#define PATCH_INDEX_ENTRY_SIZE       2
+#define PATCH_INDEX_EMPTY            0xFFFF
+#define PATCH_INDEX_CRC_OFFSET       (PATCH_INDEX_OFFSET + (PATCH_INDEX_ENTRIES * PATCH_INDEX_ENTRY_SIZE))  // CRC16 of the entries, MSB first
+#define PATCH_INDEX_SIZE             ((PATCH_INDEX_ENTRIES * PATCH_INDEX_ENTRY_SIZE) + 2)
+
+/* Record heap - records are appended at the end and compacted when full, everything past the last record is zero */
+#define PATCH_HEAP_OFFSET            (PATCH_INDEX_OFFSET + PATCH_INDEX_SIZE)
+#define PATCH_HEAP_SIZE              (JOURNAL_OFFSET - PATCH_HEAP_OFFSET)
+
+/* Offsets Within a Variable Length Patch Record */
+#define RECORD_KEY_OFFSET            0    // index key of the owner, RECORD_KEY_DEAD once superseded, not covered by the CRC
+#define RECORD_LENGTH_OFFSET         1    // whole record, key to CRC inclusive
+#define RECORD_CTRL_FLAGS_OFFSET     2
+#define RECORD_OUTPUT_MASK_OFFSET    3
+#define RECORD_TITLE_LENGTH_OFFSET   4
+#define RECORD_NUM_MIDI_OFFSET       5    // PC count in the low nibble, CC count in the high nibble
+#define RECORD_TITLE_OFFSET          6    // title, then MIDI PC entries, then MIDI CC entries, then the CRC
+#define RECORD_HEADER_SIZE           6
+#define RECORD_CRC_SIZE              2    // CRC16 from the length byte to the end of the MIDI data, MSB first
+#define RECORD_KEY_DEAD              0xFF
+#define PATCH_RECORD_MAX_SIZE        (RECORD_HEADER_SIZE + PATCH_TITLE_SIZE + PATCH_MIDI_PC_DATA_SIZE + PATCH_MIDI_CC_DATA_SIZE + RECORD_CRC_SIZE)
+
+/* Compact in-RAM patch, a copy of the on-EEPROM switch data minus the title and output mask (52 bytes vs ~120 for PATCH_DATA_X).
+The title is read on demand and the output mask is held in a dense array of its own */
+#define PACKED_NUM_MIDI_PC_MASK      0x0F
+#define PACKED_NUM_MIDI_CC_SHIFT     4    // shared with RECORD_NUM_MIDI_OFFSET
+
+typedef struct patch_packed_x
+{
+    uint8_t ctrl_flags;                              // PATCH_AMP_A_ENABLE_MASK etc. as stored
+    uint8_t num_midi;                                // PC count in the low nibble, CC count in the high nibble
+    uint8_t midi_pc[PATCH_MIDI_PC_DATA_SIZE];        // MIDI_PC_SIZE byte entries as stored
+    uint8_t midi_cc[PATCH_MIDI_CC_DATA_SIZE];        // MIDI_CC_SIZE byte entries as stored
+} PATCH_PACKED_X;
+
+/* Typed accessors for PATCH_PACKED_X */
+inline bool packed_ctrl_flag(const PATCH_PACKED_X *patch, uint8_t mask)
+{
+    return (patch->ctrl_flags & mask) != 0;
+}
+
+inline uint8_t packed_num_midi_pc(const PATCH_PACKED_X *patch)
+{
+    return patch->num_midi & PACKED_NUM_MIDI_PC_MASK;
+}
+
+inline uint8_t packed_num_midi_cc(const PATCH_PACKED_X *patch)
+{
+    return patch->num_midi >> PACKED_NUM_MIDI_CC_SHIFT;
+}
+
+inline MIDI_PC_DATA_X packed_midi_pc(const PATCH_PACKED_X *patch, uint8_t index)
+{
+    const uint8_t *entry = &patch->midi_pc[index * MIDI_PC_SIZE];
+    return {entry[0], entry[1]};
+}
+
+inline MIDI_CC_DATA_X packed_midi_cc(const PATCH_PACKED_X *patch, uint8_t index)
+{
+    const uint8_t *entry = &patch->midi_cc[index * MIDI_CC_SIZE];
+    return {entry[0], entry[1], entry[2]};
+}
+
+/* System State Journal - rotating log of the last flags/bank/patch, spreading wear over the unused upper pages */
+#define JOURNAL_OFFSET               3072
+#define JOURNAL_SIZE                 992  // 31 pages, the final page is left for the boot footer
+#define JOURNAL_RECORD_SIZE          8
+#define JOURNAL_RECORD_COUNT         (JOURNAL_SIZE / JOURNAL_RECORD_SIZE)
+
+/* Offsets Within a Journal Record */
+#define JOURNAL_SEQUENCE_OFFSET      0    // 2 bytes, MSB first
+#define JOURNAL_FLAGS_OFFSET         2
+#define JOURNAL_BANK_OFFSET          3
+#define JOURNAL_PATCH_OFFSET         4
+#define JOURNAL_CHECK_OFFSET         7
+
 
 /* i2c */
 #define I2C0_DATA    4
@@ -235,4 +353,53 @@ typedef struct bank_data_x
 /* Port Interrupt Pins */
 #define PORTA_INTERRUPT 2
 #define PORTB_INTERRUPT 3
+#define NUM_INPUT_PORTS 2
+
+#define NUM_PORT_SWITCHES 8
+
+/* Port interrupts are queued from IRQ context and serviced by the core 1 loop */
+#define INPUT_EVENT_QUEUE_LENGTH 8
+
+/* Debounce: switches are sampled every tick while changing, and a new level must be seen on 
+consecutive ticks for the press or release window before it is accepted */
+#define DEBOUNCE_TICK_US         1000
+#define DEBOUNCE_PRESS_MS        5
+#define DEBOUNCE_RELEASE_MS      20
+#define DEBOUNCE_HARDWARE_ALARM  2
+
+/* Leading-edge switches fire on the first captured edge of a press, then ignore the contact for 
+the lockout window. Opt-in per switch, one bit per expander pin */
+#define DEBOUNCE_LOCKOUT_MS      40
+#define LEADING_EDGE_MASK_A      0x00
+#define LEADING_EDGE_MASK_B      0x00
+
+typedef enum switch_state
+{
+    SWITCH_RELEASED,
+    SWITCH_PRESSING,
+    SWITCH_PRESSED,
+    SWITCH_RELEASING
+} SWITCH_STATE;
+
+typedef struct switch_debounce_x
+{
+    uint8_t state;
+    uint8_t count;      // consecutive samples at the new level
+    uint8_t revert;     // consecutive samples back at the old level
+    uint8_t lockout;    // ticks left in which a leading-edge switch ignores its contact
+    uint32_t edge_us;   // first edge of the transition
+} SWITCH_DEBOUNCE_X;
+
+typedef struct input_event_x
+{
+    uint32_t timestamp_us;
+    uint8_t gpio;
+} INPUT_EVENT_X;
+
+/* MIDI */
+#define MIDI_UART       uart0
+#define MIDI_UART_IRQ   UART0_IRQ
+#define MIDI_TX_PIN     0
+#define MIDI_RX_PIN     1
+#define MIDI_BAUD_RATE  31250
 #endif
\ No newline at end of file
@@ -0,0 +1,318 @@
+/* C Includes */
+#include <stdio.h>
+#include <string.h>
+
+/* Pico SDK Includes */
+#include "pico/stdlib.h"
+
+/* Project Includes */
+#include "input_handler.h"
+
+void InputHandler::initialise(MCP23017 *pInputPort, queue_t *tx_queue)
+{
+    #ifdef DEBUG
+    printf("Init Input Handler\n");
+    #endif
+
+    this->pInputPort = pInputPort;
+    this->tx_queue = tx_queue;
+
+    memset(switches, 0, sizeof(switches));
+    memset(pressed_mask, 0, sizeof(pressed_mask));
+    memset(leading_edge_mask, 0, sizeof(leading_edge_mask));
+    active_ports = 0;
+    interrupt_pending = false;
+    interrupt_us = 0;
+
+    set_debounce_windows(DEBOUNCE_PRESS_MS, DEBOUNCE_RELEASE_MS);
+    lockout_ticks = ((DEBOUNCE_LOCKOUT_MS * 1000) + DEBOUNCE_TICK_US - 1) / DEBOUNCE_TICK_US;
+}
+
+/* Sets how long a new level must hold before a press or release is accepted */
+void InputHandler::set_debounce_windows(uint8_t press_ms, uint8_t release_ms)
+{
+    press_ticks   = ((press_ms * 1000) + DEBOUNCE_TICK_US - 1) / DEBOUNCE_TICK_US;
+    release_ticks = ((release_ms * 1000) + DEBOUNCE_TICK_US - 1) / DEBOUNCE_TICK_US;
+}
+
+/* Selects the switches of a port which fire on their first edge, and how long their contact is ignored after */
+void InputHandler::set_leading_edge(uint8_t port, uint8_t mask, uint8_t lockout_ms)
+{
+    leading_edge_mask[port] = mask;
+    lockout_ticks = ((lockout_ms * 1000) + DEBOUNCE_TICK_US - 1) / DEBOUNCE_TICK_US;
+}
+
+/****************************************************************
+Function:   fire_leading_edge
+Arguments:  (uint8_t) port
+            (uint8_t) position
+            (uint32_t) edge_us
+Return:     bool (false if the switch debounces normally)
+
+Accepts a press on its first edge for a switch in leading-edge 
+mode. Nothing waits for the contact to settle; instead the switch
+ignores its contact for the lockout window, which covers the bounce,
+and is then sampled again so a release is debounced as usual.
+****************************************************************/
+bool InputHandler::fire_leading_edge(uint8_t port, uint8_t position, uint32_t edge_us)
+{
+    SWITCH_DEBOUNCE_X *sw = &switches[port][position];
+
+    if(!(leading_edge_mask[port] & (1 << position)))
+    {
+        return false;
+    }
+
+    sw->state = SWITCH_PRESSED;
+    sw->lockout = lockout_ticks;
+    sw->edge_us = edge_us;
+    pressed_mask[port] |= (1 << position);
+    active_ports |= (1 << port);
+
+    send_event(port, position, INPUT_EDGE_PRESS, INPUT_MODE_LEADING_EDGE, edge_us);
+    return true;
+}
+
+/****************************************************************
+Function:   port_interrupt
+Arguments:  (uint32_t) timestamp_us
+Return:     void
+
+Handles the interrupts queued by the IRQ handler with one snapshot
+of both ports. Each port whose INTF shows an interrupt is seeded 
+from its INTCAP value. If the read fails INT stays asserted and no
+further edge will arrive, so the interrupt is left pending for the
+tick to retry, keeping its original timestamp.
+****************************************************************/
+void InputHandler::port_interrupt(uint32_t timestamp_us)
+{
+    if(!pInputPort->read_input_snapshot(&snapshot))
+    {
+        if(!interrupt_pending)
+        {
+            interrupt_pending = true;
+            interrupt_us = timestamp_us;
+        }
+        return;
+    }
+
+    interrupt_pending = false;
+
+    for(uint8_t port = 0; port < NUM_INPUT_PORTS; port++)
+    {
+        if(snapshot.intf[port])
+        {
+            seed_port(port, snapshot.intcap[port], timestamp_us);
+        }
+    }
+}
+
+/****************************************************************
+Function:   seed_port
+Arguments:  (uint8_t) port
+            (uint8_t) capture
+            (uint32_t) timestamp_us
+Return:     void
+
+INTCAP holds the port as it was at the edge, so a switch which has
+already bounced back by the time of the read is still seen. Every 
+settled switch whose captured level differs starts a transition 
+stamped with the interrupt time, and the port is sampled from then
+on.
+****************************************************************/
+void InputHandler::seed_port(uint8_t port, uint8_t capture, uint32_t timestamp_us)
+{
+    SWITCH_DEBOUNCE_X *sw;
+
+    for(uint8_t position = 0; position < NUM_PORT_SWITCHES; position++)
+    {
+        sw = &switches[port][position];
+
+        if(sw->lockout)
+        {
+            continue;
+        }
+
+        if((sw->state == SWITCH_RELEASED) && (capture & (1 << position)))
+        {
+            if(fire_leading_edge(port, position, timestamp_us))
+            {
+                continue;
+            }
+            sw->state = SWITCH_PRESSING;
+        }
+        else if((sw->state == SWITCH_PRESSED) && !(capture & (1 << position)))
+        {
+            sw->state = SWITCH_RELEASING;
+        }
+        else
+        {
+            continue;
+        }
+
+        sw->count = 0;
+        sw->revert = 0;
+        sw->edge_us = timestamp_us;
+        active_ports |= (1 << port);
+    }
+}
+
+/* Called from the core 1 loop once per timer tick, samples every port with a transition in progress and retries a failed interrupt read */
+void InputHandler::tick(void)
+{
+    uint32_t now_us;
+    uint32_t seed_us;
+
+    if((!active_ports && !interrupt_pending) || !pInputPort->read_input_snapshot(&snapshot))
+    {
+        return;
+    }
+
+    now_us = time_us_32();
+    seed_us = interrupt_pending ? interrupt_us : now_us;
+    interrupt_pending = false;
+
+    for(uint8_t port = 0; port < NUM_INPUT_PORTS; port++)
+    {
+        /* The snapshot clears interrupts on both ports, so one raised since the last read is seeded here */
+        if(snapshot.intf[port])
+        {
+            seed_port(port, snapshot.intcap[port], seed_us);
+        }
+
+        if(active_ports & (1 << port))
+        {
+            sample_port(port, snapshot.gpio[port], now_us);
+        }
+    }
+}
+
+/****************************************************************
+Function:   sample_port
+Arguments:  (uint8_t) port
+            (uint8_t) value
+            (uint32_t) now_us
+Return:     void
+
+Runs each switch's state machine on one sample. A transition is 
+accepted once the new level has been seen for its window of 
+consecutive ticks, and abandoned if the old level holds for as 
+long, which filters a glitch without producing any event.
+****************************************************************/
+void InputHandler::sample_port(uint8_t port, uint8_t value, uint32_t now_us)
+{
+    SWITCH_DEBOUNCE_X *sw;
+    bool pressed;
+    bool changing = false;
+
+    for(uint8_t position = 0; position < NUM_PORT_SWITCHES; position++)
+    {
+        sw = &switches[port][position];
+        pressed = value & (1 << position);
+
+        /* The last tick of a lockout keeps the port active, so the following tick picks up any change made during it */
+        if(sw->lockout)
+        {
+            sw->lockout--;
+            changing = true;
+            continue;
+        }
+
+        switch(sw->state)
+        {
+            /* A change the interrupt has not reported yet */
+            case SWITCH_RELEASED:
+            case SWITCH_PRESSED:
+                if(pressed && (sw->state == SWITCH_RELEASED) && fire_leading_edge(port, position, now_us))
+                {
+                    changing = true;
+                }
+                else if(pressed != (sw->state == SWITCH_PRESSED))
+                {
+                    sw->state = pressed ? SWITCH_PRESSING : SWITCH_RELEASING;
+                    sw->count = 1;
+                    sw->revert = 0;
+                    sw->edge_us = now_us;
+                    changing = true;
+                }
+                break;
+
+            case SWITCH_PRESSING:
+                if(pressed)
+                {
+                    sw->revert = 0;
+                    if(++sw->count >= press_ticks)
+                    {
+                        sw->state = SWITCH_PRESSED;
+                        pressed_mask[port] |= (1 << position);
+                        send_event(port, position, INPUT_EDGE_PRESS, INPUT_MODE_DEBOUNCED, sw->edge_us);
+                        break;
+                    }
+                }
+                else
+                {
+                    sw->count = 0;
+                    if(++sw->revert >= press_ticks)
+                    {
+                        sw->state = SWITCH_RELEASED;
+                        break;
+                    }
+                }
+                changing = true;
+                break;
+
+            case SWITCH_RELEASING:
+                if(!pressed)
+                {
+                    sw->revert = 0;
+                    if(++sw->count >= release_ticks)
+                    {
+                        sw->state = SWITCH_RELEASED;
+                        pressed_mask[port] &= ~(1 << position);
+                        send_event(port, position, INPUT_EDGE_RELEASE, INPUT_MODE_DEBOUNCED, sw->edge_us);
+                        break;
+                    }
+                }
+                else
+                {
+                    sw->count = 0;
+                    if(++sw->revert >= release_ticks)
+                    {
+                        sw->state = SWITCH_PRESSED;
+                        break;
+                    }
+                }
+                changing = true;
+                break;
+        }
+    }
+
+    if(!changing)
+    {
+        active_ports &= ~(1 << port);
+    }
+}
+
+/* Sends one accepted press or release to core 0 */
+void InputHandler::send_event(uint8_t port, uint8_t position, uint8_t edge, uint8_t mode, uint32_t edge_us)
+{
+    QUEUE_ITEM_X command;
+
+    #ifdef DEBUG
+    printf("Input: Port %d, Switch %d, %s, Mask %02x, %luus after first edge\n", port, position, edge ? "Press" : "Release", pressed_mask[port], time_us_32() - edge_us);
+    #endif
+
+    memset(&command, 0, sizeof(QUEUE_ITEM_X));
+    command.instruction_code = PORT_INPUT;
+    command.data[INPUT_PORT_OFFSET]          = port;
+    command.data[INPUT_MASK_OFFSET]          = pressed_mask[port];
+    command.data[INPUT_SWITCH_OFFSET]        = position;
+    command.data[INPUT_EDGE_OFFSET]          = edge;
+    command.data[INPUT_TIMESTAMP_OFFSET]     = (uint8_t)(edge_us >> 24);
+    command.data[INPUT_TIMESTAMP_OFFSET + 1] = (uint8_t)(edge_us >> 16);
+    command.data[INPUT_TIMESTAMP_OFFSET + 2] = (uint8_t)(edge_us >> 8);
+    command.data[INPUT_TIMESTAMP_OFFSET + 3] = (uint8_t)edge_us;
+    command.data[INPUT_MODE_OFFSET]          = mode;
+
+    queue_try_add(tx_queue, &command);
+}
@@ -0,0 +1,56 @@
+#ifndef INPUT_HANDLER_H
+#define INPUT_HANDLER_H
+
+/* C/C++ Includes */
+
+/* Pico SDK Includes */
+#include "pico/stdlib.h"
+#include "pico/util/queue.h"
+
+/* Project Includes */
+#include "gpio_defs.h"
+#include "MCP23017.H"
+
+class InputHandler
+{
+    private:
+        /* Associations */
+        MCP23017 *pInputPort;
+        queue_t *tx_queue;
+
+        /* INTF, INTCAP and GPIO of both ports, from one burst read */
+        MCP23017_INPUT_X snapshot;
+
+        /* Per-switch debounce state, and the accepted pressed mask of each port */
+        SWITCH_DEBOUNCE_X switches[NUM_INPUT_PORTS][NUM_PORT_SWITCHES];
+        uint8_t pressed_mask[NUM_INPUT_PORTS];
+
+        /* One bit per port with a switch mid-transition, only these are sampled on a tick */
+        uint8_t active_ports;
+
+        /* An interrupt whose snapshot read failed, retried from the tick until INT is cleared */
+        bool interrupt_pending;
+        uint32_t interrupt_us;
+
+        /* Integration windows and the leading-edge lockout, in ticks */
+        uint8_t press_ticks;
+        uint8_t release_ticks;
+        uint8_t lockout_ticks;
+
+        /* Switches which fire on the first edge of a press */
+        uint8_t leading_edge_mask[NUM_INPUT_PORTS];
+
+        void seed_port(uint8_t port, uint8_t capture, uint32_t timestamp_us);
+        bool fire_leading_edge(uint8_t port, uint8_t position, uint32_t edge_us);
+        void sample_port(uint8_t port, uint8_t value, uint32_t now_us);
+        void send_event(uint8_t port, uint8_t position, uint8_t edge, uint8_t mode, uint32_t edge_us);
+
+    public:
+        void initialise(MCP23017 *pInputPort, queue_t *tx_queue);
+        void set_debounce_windows(uint8_t press_ms, uint8_t release_ms);
+        void set_leading_edge(uint8_t port, uint8_t mask, uint8_t lockout_ms);
+        void port_interrupt(uint32_t timestamp_us);
+        void tick(void);
+};
+
+#endif
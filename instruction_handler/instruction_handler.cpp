@@ -23,6 +23,11 @@ void InstructionHandler::initialise(StateManager *pStateManager,
     this->pStorageManager = pStorageManager;
     this->tx_queue = tx_queue;
     this->rx_queue = rx_queue;
+
+    message_active = false;
+
+    memset(input_latency_us, 0, sizeof(input_latency_us));
+    memset(max_input_latency_us, 0, sizeof(max_input_latency_us));
 }
 
 void InstructionHandler::startup_routine(void)
@@ -92,21 +97,41 @@ void InstructionHandler::read_queue(void)
 {
     if(queue_try_remove(rx_queue, &queue_store))
     {
+        /* The display shares the EEPROM's bus, let any DMA transfer finish first */
+        pStorageManager->release_bus();
+
         switch(queue_store.instruction_code)
         {
             case PORT_INPUT:
                 decode_port_input();
                 break;
+
+            case STORAGE_RESULT:
+                storage_result_handler();
+                break;
         }
     }
+    else
+    {
+        /* Nothing to do, run any pending storage work */
+        pStorageManager->service();
+        pStateManager->prefetch_banks();
+        service_message();
+    }
 }
 
 void InstructionHandler::decode_port_input(void)
 {
-    switch(queue_store.data[0])
+    /* Actions fire on presses, a release only updates the pressed mask */
+    if(queue_store.data[INPUT_EDGE_OFFSET] != INPUT_EDGE_PRESS)
+    {
+        return;
+    }
+
+    switch(queue_store.data[INPUT_PORT_OFFSET])
     {
         case PORTA:
-            switch(queue_store.data[1])
+            switch(queue_store.data[INPUT_MASK_OFFSET])
             {
                 case SW_1_MASK: /* fall through */
                 case SW_2_MASK: /* fall through */
@@ -120,6 +145,7 @@ void InstructionHandler::decode_port_input(void)
                     /* do something manspider! */
                     pStateManager->increment_bank();
                     pStateManager->load_new_bank();
+                    pStorageManager->write_active_bank(pStateManager->get_active_bank());
                     pStateManager->set_active_patch(5); //TODO: this is a placeholder for now
                     pDisplayManager->update();
                     break;
@@ -128,13 +154,15 @@ void InstructionHandler::decode_port_input(void)
                     /* Execute order 66! */
                     pStateManager->decrement_bank();
                     pStateManager->load_new_bank();
+                    pStorageManager->write_active_bank(pStateManager->get_active_bank());
                     pStateManager->set_active_patch(5); //TODO: this is a placeholder for now
                     pDisplayManager->update();
                     break; /* it will be done my lord */
             }
-            
+            break;
+
         case PORTB:
-            switch(queue_store.data[1])
+            switch(queue_store.data[INPUT_MASK_OFFSET])
             {
                 case SW_WRITE_MASK:
                     write_command_handler();
@@ -149,6 +177,44 @@ void InstructionHandler::decode_port_input(void)
             break;
 
     }
+
+    record_input_latency();
+}
+
+/* Latency is kept per input mode so leading-edge and debounced switching can be compared on the same pedal.
+It runs from the first contact edge to the action completing, so it includes the wait for core 0 to reach the queue */
+void InstructionHandler::record_input_latency(void)
+{
+    const uint8_t *timestamp = &queue_store.data[INPUT_TIMESTAMP_OFFSET];
+    uint8_t mode = queue_store.data[INPUT_MODE_OFFSET];
+    uint32_t edge_us;
+
+    if(mode >= INPUT_MODE_COUNT)
+    {
+        return;
+    }
+
+    edge_us = ((uint32_t)timestamp[0] << 24) | ((uint32_t)timestamp[1] << 16) | ((uint32_t)timestamp[2] << 8) | timestamp[3];
+    input_latency_us[mode] = time_us_32() - edge_us;
+
+    if(input_latency_us[mode] > max_input_latency_us[mode])
+    {
+        max_input_latency_us[mode] = input_latency_us[mode];
+    }
+
+    #ifdef DEBUG
+    printf("Input Latency (%s): %luus, Max: %luus\n", (mode == INPUT_MODE_LEADING_EDGE) ? "Leading Edge" : "Debounced", input_latency_us[mode], max_input_latency_us[mode]);
+    #endif
+}
+
+uint32_t InstructionHandler::get_input_latency_us(uint8_t mode)
+{
+    return input_latency_us[mode];
+}
+
+uint32_t InstructionHandler::get_max_input_latency_us(uint8_t mode)
+{
+    return max_input_latency_us[mode];
 }
 
 void InstructionHandler::port_a_command_handler(uint8_t input_mask)
@@ -198,6 +264,7 @@ void InstructionHandler::port_a_command_handler(uint8_t input_mask)
     #endif
             pStateManager->set_active_patch(array_pos);
             pStateManager->load_output_state();
+            pStorageManager->write_active_patch(array_pos);
             break;
             
         case WRITE:
@@ -256,8 +323,6 @@ void InstructionHandler::mode_command_handler()
 
 void InstructionHandler::write_command_handler()
 {
-    static char *str;
-    
     switch(pStateManager->get_mode())
     {
         case MANUAL: // fall through
@@ -266,34 +331,32 @@ void InstructionHandler::write_command_handler()
             pStateManager->set_write_location(6);
             break;
 
-        /* insert current output state into appropriate store location and save to flash */
+        /* insert current output state into appropriate store location and queue it to be saved */
         case WRITE:
             /* if a location has been selected */
             if(pStateManager->copy_output_state()) 
             {
-                /* if the write is readback successfully */
-                if(pStorageManager->write_patch_switch_data() == 0)
+                /* The save runs in the background, its result comes back as a STORAGE_RESULT queue item */
+                if(pStorageManager->queue_patch_switch_data(pStateManager->get_active_bank(),
+                                                            pStateManager->get_write_location(),
+                                                            pStateManager->get_output_mask()))
                 {
-                    pDisplayManager->clear();
-                    memcpy(str, ">OK<", 4);
                     pStateManager->set_mode(PROGRAM);
                     pStateManager->set_active_patch(pStateManager->get_write_location());
                 }
                 else
                 {
-                    memcpy(str, "-Err", 4);
+                    memcpy(msg_str, "Busy", 4);
+                    show_message(msg_str);
+                    return;
                 }
-                sleep_ms(500);
-                pDisplayManager->write_string(str); //TODO: Blinking???
             }
             else
             {
-                memcpy(str, "Sel_", 4);
-                pDisplayManager->write_string(str);
-                sleep_ms(500);
+                memcpy(msg_str, "Sel_", 4);
+                show_message(msg_str);
+                return;
             }
-
-            //TODO: stuff here
             break;
         default:
             //should never get here
@@ -301,3 +364,34 @@ void InstructionHandler::write_command_handler()
     }
     pDisplayManager->update();
 }
+
+/* Reports the outcome of a background save */
+void InstructionHandler::storage_result_handler(void)
+{
+    if(queue_store.data[1] == 0)
+    {
+        memcpy(msg_str, ">OK<", 4);
+    }
+    else
+    {
+        memcpy(msg_str, "-Err", 4); //TODO: Blinking???
+    }
+    show_message(msg_str);
+}
+
+/* Shows a message without blocking, the normal display is restored by service_message() */
+void InstructionHandler::show_message(char *str)
+{
+    pDisplayManager->write_string(str);
+    message_expiry_us = time_us_64() + (MESSAGE_DISPLAY_MS * 1000);
+    message_active = true;
+}
+
+void InstructionHandler::service_message(void)
+{
+    if(message_active && (time_us_64() > message_expiry_us))
+    {
+        message_active = false;
+        pDisplayManager->update();
+    }
+}
@@ -15,6 +15,9 @@
 #include "display_manager.h"
 #include "storage_manager.h"
 
+/* How long a status message stays on the display */
+#define MESSAGE_DISPLAY_MS 500
+
 class InstructionHandler
 {
     private:
@@ -32,6 +35,14 @@ class InstructionHandler
 
         /* For formatting strings for HT16K33 */
         char msg_str[5];
+        bool message_active;
+        uint64_t message_expiry_us;
+
+        /* Time from the first contact edge of a press to its action completing, per input mode */
+        uint32_t input_latency_us[INPUT_MODE_COUNT];
+        uint32_t max_input_latency_us[INPUT_MODE_COUNT];
+
+        void record_input_latency(void);
 
     public:
 
@@ -49,6 +60,11 @@ class InstructionHandler
         void port_a_command_handler(uint8_t input_mask);
         void mode_command_handler(void);
         void write_command_handler(void);
+        void storage_result_handler(void);
+        void show_message(char *str);
+        void service_message(void);
+        uint32_t get_input_latency_us(uint8_t mode);
+        uint32_t get_max_input_latency_us(uint8_t mode);
 };
 
 #endif
@@ -19,6 +19,9 @@
 #include "instruction_handler.h"
 #include "display_manager.h"
 #include "storage_manager.h"
+#include "flash_library.h"
+#include "backup_manager.h"
+#include "midi_manager.h"
 #include "CAT24C32.h"
 #include "MCP23017.H"
 
@@ -29,6 +32,9 @@ StateManager *state_mgr;
 OutputManager *output_mgr;
 DisplayManager *display_mgr;
 StorageManager *storage_mgr;
+FlashLibrary *flash_library;
+BackupManager *backup_mgr;
+MidiManager *midi_mgr;
 
 queue_t *core_0_queue_tx = new queue_t;
 queue_t *core_0_queue_rx = new queue_t;
@@ -37,6 +43,10 @@ queue_t *core_0_queue_rx = new queue_t;
 int main()
 {   
     stdio_init_all();
+
+#ifdef DEBUG
+    stack_paint();
+#endif
     sleep_ms(5000);
 
     queue_init_with_spinlock(core_0_queue_tx, sizeof(QUEUE_ITEM_X), 5, 1);
@@ -63,6 +73,9 @@ int main()
     output_mgr = new OutputManager;
     display_mgr = new DisplayManager(i2c1, QUAD_ADDR);
     storage_mgr = new StorageManager(i2c1, EEPROM_ADDR);
+    flash_library = new FlashLibrary;
+    backup_mgr = new BackupManager;
+    midi_mgr = new MidiManager;
     state_mgr = new StateManager;
 
 #ifdef DEBUG
@@ -91,15 +104,20 @@ int main()
                                     core_0_queue_rx);
                                          
     state_mgr->initialise(storage_mgr);
-    storage_mgr->initialise(state_mgr);
+    storage_mgr->initialise(state_mgr, flash_library, core_0_queue_rx);
+    flash_library->initialise();
+    backup_mgr->initialise(storage_mgr, state_mgr);
+    midi_mgr->initialise(storage_mgr, state_mgr);
     display_mgr->initialise(state_mgr);
 
     instruction_handler->startup_routine();
 
+    /* Poll without sleeping so a queued input is picked up within one pass of the loop */
     while(true)
     {
         instruction_handler->read_queue();
-        sleep_ms(16);
+        backup_mgr->service();
+        midi_mgr->service();
     }
 }
 
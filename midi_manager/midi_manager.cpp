@@ -0,0 +1,334 @@
+/* C Includes */
+#include <string.h>
+#include <stdio.h>
+
+/* Pico SDK Includes */
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/irq.h"
+
+/* Project Includes */
+#include "midi_manager.h"
+#include "storage_image.h"
+
+static_assert((MIDI_RX_BUFFER_SIZE & (MIDI_RX_BUFFER_SIZE - 1)) == 0, "RX buffer size must be a power of two");
+static_assert((MIDI_TX_BUFFER_SIZE & (MIDI_TX_BUFFER_SIZE - 1)) == 0, "TX buffer size must be a power of two");
+static_assert(SYSTEM_INFO_SIZE <= PATCH_RECORD_MAX_SIZE, "System dumps are sized for patch records");
+
+/* Shared with the UART interrupt. Each index is only ever written from one side */
+static uint8_t rx_buffer[MIDI_RX_BUFFER_SIZE];
+static volatile uint16_t rx_head;
+static volatile uint16_t rx_tail;
+static uint8_t tx_buffer[MIDI_TX_BUFFER_SIZE];
+static volatile uint16_t tx_head;
+static volatile uint16_t tx_tail;
+
+/* Keeps the TX FIFO topped up, the TX interrupt stays enabled only while there is more to send */
+static void midi_uart_drain_tx(void)
+{
+    while((tx_tail != tx_head) && uart_is_writable(MIDI_UART))
+    {
+        uart_putc_raw(MIDI_UART, tx_buffer[tx_tail]);
+        tx_tail = (tx_tail + 1) & (MIDI_TX_BUFFER_SIZE - 1);
+    }
+
+    uart_set_irq_enables(MIDI_UART, true, tx_tail != tx_head);
+}
+
+/* Bytes arriving with the RX buffer full are dropped, the CRC of the dump they belong to will fail */
+static void midi_uart_irq(void)
+{
+    uint16_t next;
+
+    while(uart_is_readable(MIDI_UART))
+    {
+        uint8_t byte = (uint8_t)uart_getc(MIDI_UART);
+
+        next = (rx_head + 1) & (MIDI_RX_BUFFER_SIZE - 1);
+        if(next != rx_tail)
+        {
+            rx_buffer[rx_head] = byte;
+            rx_head = next;
+        }
+    }
+
+    midi_uart_drain_tx();
+}
+
+static uint16_t midi_tx_free(void)
+{
+    return (tx_tail - tx_head - 1) & (MIDI_TX_BUFFER_SIZE - 1);
+}
+
+/* Packs 8-bit data into 7-bit groups, a byte of top bits followed by up to seven bytes with the top bit cleared */
+static uint16_t sysex_pack(const uint8_t *source, uint16_t length, uint8_t *destination)
+{
+    uint16_t count = 0;
+    uint8_t *top_bits;
+
+    for(uint16_t i = 0; i < length; i += 7)
+    {
+        top_bits = &destination[count++];
+        *top_bits = 0;
+
+        for(uint8_t j = 0; (j < 7) && ((i + j) < length); j++)
+        {
+            *top_bits |= (source[i + j] >> 7) << j;
+            destination[count++] = source[i + j] & 0x7F;
+        }
+    }
+    return count;
+}
+
+/* Reverses sysex_pack(), the result is always shorter than the packed data */
+static uint16_t sysex_unpack(const uint8_t *source, uint16_t length, uint8_t *destination)
+{
+    uint16_t count = 0;
+    uint8_t top_bits = 0;
+
+    for(uint16_t i = 0; i < length; i++)
+    {
+        if((i % 8) == 0)
+        {
+            top_bits = source[i];
+            continue;
+        }
+        destination[count++] = source[i] | (((top_bits >> ((i % 8) - 1)) & 1) << 7);
+    }
+    return count;
+}
+
+void MidiManager::initialise(StorageManager *pStorageManager, StateManager *pStateManager)
+{
+    #ifdef DEBUG
+    printf("Init MIDI Manager\n");
+    #endif
+
+    this->pStorageManager = pStorageManager;
+    this->pStateManager = pStateManager;
+
+    rx_count = 0;
+    rx_active = false;
+    dump_system = false;
+    dump_key = 0;
+    dump_end_key = 0;
+
+    rx_head = 0;
+    rx_tail = 0;
+    tx_head = 0;
+    tx_tail = 0;
+
+    uart_init(MIDI_UART, MIDI_BAUD_RATE);
+    gpio_set_function(MIDI_TX_PIN, GPIO_FUNC_UART);
+    gpio_set_function(MIDI_RX_PIN, GPIO_FUNC_UART);
+    uart_set_hw_flow(MIDI_UART, false, false);
+    uart_set_format(MIDI_UART, 8, 1, UART_PARITY_NONE);
+    uart_set_fifo_enabled(MIDI_UART, true);
+
+    irq_set_exclusive_handler(MIDI_UART_IRQ, midi_uart_irq);
+    irq_set_enabled(MIDI_UART_IRQ, true);
+    uart_set_irq_enables(MIDI_UART, true, false);
+}
+
+/****************************************************************
+Function:   service
+Arguments:  none
+Return:     void
+
+Called from the main loop, never blocks. The UART interrupt moves
+bytes between the FIFOs and the ring buffers at line rate, while 
+this tops the transmit buffer up with the next dump messages and 
+handles completed requests. Incoming messages are only handled 
+once there is room for the reply, which paces a host that sends 
+requests faster than the replies can go out.
+****************************************************************/
+void MidiManager::service(void)
+{
+    continue_dump();
+
+    while((rx_tail != rx_head) && (midi_tx_free() >= MIDI_SYSEX_MAX_SIZE))
+    {
+        receive_byte(rx_buffer[rx_tail]);
+        rx_tail = (rx_tail + 1) & (MIDI_RX_BUFFER_SIZE - 1);
+    }
+}
+
+/* Collects a SysEx message. Real-time bytes may appear anywhere and are skipped, any other status byte ends the message */
+void MidiManager::receive_byte(uint8_t byte)
+{
+    uint16_t length;
+
+    if(byte >= MIDI_REALTIME_FIRST)
+    {
+        return;
+    }
+
+    if(byte == MIDI_SYSEX_START)
+    {
+        rx_count = 0;
+        rx_active = true;
+        return;
+    }
+
+    if(!rx_active)
+    {
+        return;
+    }
+
+    if(byte & MIDI_STATUS_MASK)
+    {
+        rx_active = false;
+
+        if((byte != MIDI_SYSEX_END) || (rx_count < MIDI_SYSEX_DATA_OFFSET) ||
+           (rx_message[MIDI_SYSEX_ID_OFFSET] != MIDI_SYSEX_ID) ||
+           ((rx_message[MIDI_SYSEX_DEVICE_OFFSET] != MIDI_DEVICE_ID) && (rx_message[MIDI_SYSEX_DEVICE_OFFSET] != MIDI_DEVICE_ALL)))
+        {
+            return;
+        }
+
+        length = sysex_unpack(&rx_message[MIDI_SYSEX_DATA_OFFSET], rx_count - MIDI_SYSEX_DATA_OFFSET, payload);
+        handle_message(rx_message[MIDI_SYSEX_COMMAND_OFFSET], payload, length);
+        return;
+    }
+
+    /* Longer than any message of ours, so not meant for us */
+    if(rx_count == sizeof(rx_message))
+    {
+        rx_active = false;
+        return;
+    }
+
+    rx_message[rx_count++] = byte;
+}
+
+void MidiManager::handle_message(uint8_t command, const uint8_t *data, uint16_t length)
+{
+    uint8_t status;
+
+    switch(command)
+    {
+        case MIDI_CMD_REQUEST_SYSTEM:
+            dump_system = true;
+            break;
+
+        case MIDI_CMD_REQUEST_BANK:
+            if((length != 1) || (data[0] >= STORAGE_MAX_BANKS))
+            {
+                send_ack(command, 1);
+                break;
+            }
+            dump_key = patch_key(data[0], 0);
+            dump_end_key = dump_key + NUM_PATCHES;
+            break;
+
+        case MIDI_CMD_REQUEST_PATCH:
+            if((length != 2) || (pStorageManager->patch_record(data[0], data[1]) == nullptr))
+            {
+                send_ack(command, 1);
+                break;
+            }
+            dump_key = patch_key(data[0], data[1]);
+            dump_end_key = dump_key + 1;
+            break;
+
+        case MIDI_CMD_REQUEST_ALL:
+            dump_system = true;
+            dump_key = 0;
+            dump_end_key = PATCH_INDEX_ENTRIES;
+            break;
+
+        /* Dumps are staged in the write-back cache and reach the EEPROM through the idle flush, so a 
+        bank or library arriving back to back is written a page at a time between switch presses */
+        case MIDI_CMD_SYSTEM_DUMP:
+            status = (length == SYSTEM_INFO_SIZE) ? pStorageManager->restore_system_block(data) : 1;
+            if(status == 0)
+            {
+                pStateManager->invalidate_bank_cache();
+                pStateManager->load_memory_store();
+            }
+            send_ack(command, status);
+            break;
+
+        case MIDI_CMD_PATCH_DUMP:
+            status = pStorageManager->restore_record(data, length);
+            if(status == 0)
+            {
+                pStateManager->invalidate_patch(data[RECORD_KEY_OFFSET] / NUM_PATCHES, data[RECORD_KEY_OFFSET] % NUM_PATCHES);
+            }
+            send_ack(command, status);
+            break;
+
+        default:
+            break;
+    }
+
+    continue_dump();
+}
+
+/* Queues dump messages while the transmit buffer has room for a whole one, keys without a record are skipped */
+void MidiManager::continue_dump(void)
+{
+    const uint8_t *record;
+
+    while(midi_tx_free() >= MIDI_SYSEX_MAX_SIZE)
+    {
+        if(dump_system)
+        {
+            pStorageManager->read_system_block(payload);
+            send_message(MIDI_CMD_SYSTEM_DUMP, payload, SYSTEM_INFO_SIZE);
+            dump_system = false;
+            continue;
+        }
+
+        if(dump_key >= dump_end_key)
+        {
+            return;
+        }
+
+        record = pStorageManager->patch_record(dump_key / NUM_PATCHES, dump_key % NUM_PATCHES);
+        dump_key++;
+
+        if(record != nullptr)
+        {
+            send_message(MIDI_CMD_PATCH_DUMP, record, record[RECORD_LENGTH_OFFSET]);
+        }
+    }
+}
+
+void MidiManager::send_ack(uint8_t command, uint8_t status)
+{
+    uint8_t ack[2] = {command, status};
+
+    send_message(MIDI_CMD_ACK, ack, 2);
+}
+
+/* Packs a message into the transmit buffer and starts the interrupt driven send, returns false if there is no room */
+bool MidiManager::send_message(uint8_t command, const uint8_t *data, uint16_t length)
+{
+    uint16_t size = 0;
+
+    tx_message[size++] = MIDI_SYSEX_START;
+    tx_message[size++] = MIDI_SYSEX_ID;
+    tx_message[size++] = MIDI_DEVICE_ID;
+    tx_message[size++] = command;
+    size += sysex_pack(data, length, &tx_message[size]);
+    tx_message[size++] = MIDI_SYSEX_END;
+
+    if(size > midi_tx_free())
+    {
+        return false;
+    }
+
+    for(uint16_t i = 0; i < size; i++)
+    {
+        tx_buffer[tx_head] = tx_message[i];
+        tx_head = (tx_head + 1) & (MIDI_TX_BUFFER_SIZE - 1);
+    }
+
+    /* The interrupt only fires as the FIFO drains, so the first bytes are sent from here */
+    irq_set_enabled(MIDI_UART_IRQ, false);
+    midi_uart_drain_tx();
+    irq_set_enabled(MIDI_UART_IRQ, true);
+
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef MIDI_MANAGER_H
+#define MIDI_MANAGER_H
+
+/* C/C++ Includes */
+
+/* Pico Includes */
+#include "pico/stdlib.h"
+
+/* Project Includes */
+#include "gpio_defs.h"
+#include "storage_manager.h"
+#include "state_manager.h"
+
+/* SysEx preset dump protocol:
+
+   F0 7D <device> <command> <data...> F7
+
+   Everything after the command byte is 7-bit packed. Each group of up
+   to seven bytes is sent as one byte holding their top bits (bit 0 for
+   the first byte of the group), then the bytes with the top bit cleared.
+   Dumps carry the system info block or a patch record exactly as stored
+   in EEPROM. Both have their own CRC16, so no further checksum is added.
+   Requests are answered with dumps, and received dumps with an ACK.
+   Bank numbers cover the NUM_BANKS EEPROM banks, the flash library is
+   not reachable over MIDI. */
+#define MIDI_SYSEX_START          0xF0
+#define MIDI_SYSEX_END            0xF7
+#define MIDI_STATUS_MASK          0x80
+#define MIDI_REALTIME_FIRST       0xF8
+#define MIDI_SYSEX_ID             0x7D    // non-commercial manufacturer ID
+#define MIDI_DEVICE_ID            0x00
+#define MIDI_DEVICE_ALL           0x7F
+#define MIDI_SYSEX_ID_OFFSET      0       // offsets into a received message, after the F0
+#define MIDI_SYSEX_DEVICE_OFFSET  1
+#define MIDI_SYSEX_COMMAND_OFFSET 2
+#define MIDI_SYSEX_DATA_OFFSET    3
+#define MIDI_PACKED_SIZE(n)       ((n) + (((n) + 6) / 7))
+#define MIDI_SYSEX_MAX_SIZE       (MIDI_SYSEX_DATA_OFFSET + MIDI_PACKED_SIZE(PATCH_RECORD_MAX_SIZE) + 2)
+
+/* Ring buffers between the UART interrupt and the main loop, must be powers of two */
+#define MIDI_RX_BUFFER_SIZE       256
+#define MIDI_TX_BUFFER_SIZE       512
+
+/* Commands */
+#define MIDI_CMD_REQUEST_SYSTEM   0x01    // no data
+#define MIDI_CMD_REQUEST_BANK     0x02    // [bank]
+#define MIDI_CMD_REQUEST_PATCH    0x03    // [bank, patch]
+#define MIDI_CMD_REQUEST_ALL      0x04    // no data, the system block then every stored patch
+#define MIDI_CMD_SYSTEM_DUMP      0x11    // [system info block]
+#define MIDI_CMD_PATCH_DUMP       0x12    // [patch record]
+#define MIDI_CMD_ACK              0x7F    // [command, status], status 0 on success
+
+class MidiManager
+{
+    private:
+        /* Associations */
+        StorageManager *pStorageManager;
+        StateManager *pStateManager;
+
+        /* SysEx message being received, from the byte after F0 */
+        uint8_t rx_message[MIDI_SYSEX_MAX_SIZE];
+        uint16_t rx_count;
+        bool rx_active;
+
+        /* Unpacked message data, and the message being sent */
+        uint8_t payload[MIDI_SYSEX_MAX_SIZE];
+        uint8_t tx_message[MIDI_SYSEX_MAX_SIZE];
+
+        /* Dump in progress, one message is generated each time the transmit buffer has room */
+        bool dump_system;
+        uint8_t dump_key;
+        uint8_t dump_end_key;
+
+        void receive_byte(uint8_t byte);
+        void handle_message(uint8_t command, const uint8_t *data, uint16_t length);
+        void continue_dump(void);
+        bool send_message(uint8_t command, const uint8_t *data, uint16_t length);
+        void send_ack(uint8_t command, uint8_t status);
+
+    public:
+        void initialise(StorageManager *pStorageManager, StateManager *pStateManager);
+        void service(void);
+};
+
+#endif
@@ -9,6 +9,7 @@
 /* Project Includes */
 #include "state_manager.h"
 #include "storage_manager.h"
+#include "debug.h"
 
 void StateManager::initialise(StorageManager *pStorageManager)
 {
@@ -18,6 +19,40 @@ void StateManager::initialise(StorageManager *pStorageManager)
 
     this->pStorageManager = pStorageManager;
     output_mask = 0;
+
+    memset(bank_cache, 0, sizeof(bank_cache));
+    memset(output_masks, 0, sizeof(output_masks));
+    memset(bank_cache_tag, -1, sizeof(bank_cache_tag));
+    memset(bank_loaded, 0, sizeof(bank_loaded));
+    loaded_slot = 0;
+    bank_cache_hits = 0;
+    bank_cache_misses = 0;
+}
+
+/* Drops every cached bank, used when the stored presets are replaced underneath the cache */
+void StateManager::invalidate_bank_cache(void)
+{
+    memset(bank_cache_tag, -1, sizeof(bank_cache_tag));
+    memset(bank_loaded, 0, sizeof(bank_loaded));
+    loaded_slot = 0;
+}
+
+/* Drops one cached patch after its record is replaced. The active bank reloads it now, any other bank when next used */
+void StateManager::invalidate_patch(uint8_t bank, uint8_t patch)
+{
+    int8_t slot = find_cached_bank(bank);
+
+    if((slot < 0) || (patch >= NUM_PATCHES))
+    {
+        return;
+    }
+
+    bank_loaded[slot] &= ~(1 << patch);
+
+    if(bank == active_bank)
+    {
+        load_patch_now(patch);
+    }
 }
 
 /****************************************************************
@@ -48,16 +83,167 @@ void StateManager::load_memory_store(void)
     load_new_bank();
 }
 
+/****************************************************************
+Function:   load_new_bank
+Arguments:  none
+Return:     void
+
+Points loaded_slot at the active bank in the bank cache. On a miss 
+a slot is claimed but nothing is read, so the display can update
+straight away; prefetch_banks() then loads the bank a patch at a 
+time, followed by the banks around it.
+****************************************************************/
 void StateManager::load_new_bank(void)
 {
+    int8_t slot = find_cached_bank(active_bank);
+
     printf("StateManager::load_new_bank()\n");
-    loaded_bank = pStorageManager->read_bank(active_bank);
+
+    #ifdef DEBUG
+    printf(" - Stack high water before: %lu bytes\n", stack_high_water());
+    #endif
+
+    if(slot < 0)
+    {
+        bank_cache_misses++;
+        slot = fill_cache_slot(active_bank);
+    }
+    else
+    {
+        bank_cache_hits++;
+    }
+    loaded_slot = slot;
+
     #ifdef DEBUG
-    printf(" - Loaded active bank: %d\n", active_bank);
+    printf(" - Loaded active bank: %d (cache hits: %lu, misses: %lu)\n", active_bank, bank_cache_hits, bank_cache_misses);
+    printf(" - Stack high water after: %lu bytes\n", stack_high_water());
     fflush(stdout);
     #endif
 }
 
+/* Does one step of background loading per call from the idle loop: the active bank first, then outwards from it */
+void StateManager::prefetch_banks(void)
+{
+    int8_t slot;
+    int16_t bank;
+
+    if(load_next_patch(loaded_slot))
+    {
+        return;
+    }
+
+    /* +1, -1, +2, -2 ... */
+    for(uint8_t i = 1; i < (BANK_CACHE_SIZE * 2); i++)
+    {
+        bank = active_bank + ((i & 1) ? ((i + 1) / 2) : -(i / 2));
+        if((bank < 0) || (bank >= TOTAL_BANKS))
+        {
+            continue;
+        }
+
+        slot = find_cached_bank(bank);
+        if(slot < 0)
+        {
+            slot = fill_cache_slot(bank);
+        }
+
+        if((slot >= 0) && load_next_patch(slot))
+        {
+            return;
+        }
+    }
+}
+
+/* Loads the next patch still missing from a slot. Returns false once the bank is complete */
+bool StateManager::load_next_patch(uint8_t slot)
+{
+    if(bank_cache_tag[slot] < 0)
+    {
+        return false;
+    }
+
+    for(uint8_t patch = 0; patch < NUM_PATCHES; patch++)
+    {
+        if(!(bank_loaded[slot] & (1 << patch)))
+        {
+            output_masks[slot][patch] = pStorageManager->read_patch_packed(bank_cache_tag[slot], patch, &bank_cache[slot][patch]);
+            bank_loaded[slot] |= (1 << patch);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* A patch which is needed now jumps the background queue */
+void StateManager::load_patch_now(uint8_t patch)
+{
+    if((patch >= NUM_PATCHES) || (bank_cache_tag[loaded_slot] < 0))
+    {
+        return;
+    }
+
+    if(!(bank_loaded[loaded_slot] & (1 << patch)))
+    {
+        output_masks[loaded_slot][patch] = pStorageManager->read_patch_packed(active_bank, patch, &bank_cache[loaded_slot][patch]);
+        bank_loaded[loaded_slot] |= (1 << patch);
+    }
+}
+
+int8_t StateManager::find_cached_bank(uint8_t bank)
+{
+    for(uint8_t i = 0; i < BANK_CACHE_SIZE; i++)
+    {
+        if(bank_cache_tag[i] == bank)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* How many banks away from the active bank, empty slots count as furthest away */
+uint8_t StateManager::bank_distance(int16_t bank)
+{
+    if(bank < 0)
+    {
+        return 0xFF;
+    }
+    return (bank > active_bank) ? (bank - active_bank) : (active_bank - bank);
+}
+
+/****************************************************************
+Function:   fill_cache_slot
+Arguments:  (uint8_t) bank
+Return:     int8_t (slot, or -1 if every slot holds a closer bank)
+
+Claims the slot holding the bank furthest from the active bank, if
+that is further away than the bank being loaded. Nothing is read,
+the slot is filled by load_next_patch().
+****************************************************************/
+int8_t StateManager::fill_cache_slot(uint8_t bank)
+{
+    int8_t slot = -1;
+    uint8_t furthest = bank_distance(bank);
+
+    for(uint8_t i = 0; i < BANK_CACHE_SIZE; i++)
+    {
+        if(bank_distance(bank_cache_tag[i]) > furthest)
+        {
+            furthest = bank_distance(bank_cache_tag[i]);
+            slot = i;
+        }
+    }
+
+    if(slot >= 0)
+    {
+        bank_cache_tag[slot] = bank;
+        bank_loaded[slot] = 0;
+    }
+
+    return slot;
+}
+
 
 /****************************************************************
 Function:   toggle_single_output_state
@@ -87,7 +273,8 @@ Loads a complete set of patch output values into the output_state.
 ****************************************************************/
 void StateManager::load_output_state(void)
 {
-    this->output_mask = loaded_bank.patch_array[active_patch].output_mask;
+    load_patch_now(active_patch);
+    this->output_mask = output_masks[loaded_slot][active_patch];
 }
 
 void StateManager::clear_output_mask(void)
@@ -102,13 +289,16 @@ Return:     void
 
 Copies the malleable output_state array values into the currently
 selected BANK/PATCH position in the bank_array to be written to
-flash.
+flash. The cached bank is updated in place so it stays in step with
+the EEPROM.
 ****************************************************************/
 bool StateManager::copy_output_state(void)
 {
     if(write_location < 5)
     {
-        loaded_bank.patch_array[active_patch].output_mask = output_mask;
+        /* Load the patch first so the background loader cannot overwrite the new mask with the stored one */
+        load_patch_now(write_location);
+        output_masks[loaded_slot][write_location] = output_mask;
         return true;
     }
     else
@@ -163,12 +353,13 @@ u_int8_t StateManager::get_active_bank(void)
 
 void StateManager::set_active_bank(uint8_t bank)
 {
-    active_bank = bank;
+    active_bank = (bank < TOTAL_BANKS) ? bank : 0;
 }
 
+/* Navigation runs on from the EEPROM banks into the flash library */
 void StateManager::increment_bank(void)
 {
-    if(active_bank < (NUM_BANKS - 1))
+    if(active_bank < (TOTAL_BANKS - 1))
     {
         active_bank++;
     }
@@ -194,7 +385,20 @@ void StateManager::set_active_patch(uint8_t patch)
 
 char * StateManager::get_active_patch_title(void)
 {
-    return loaded_bank.patch_array[active_patch].title;
+    title_buffer[0] = 0;
+
+    if(active_patch < NUM_PATCHES)
+    {
+        pStorageManager->read_patch_title(active_bank, active_patch, title_buffer);
+    }
+    return title_buffer;
+}
+
+/* Switch data of the active patch, decoded through the packed_ accessors in gpio_defs.h */
+const PATCH_PACKED_X * StateManager::get_active_patch_data(void)
+{
+    load_patch_now(active_patch);
+    return &bank_cache[loaded_slot][(active_patch < NUM_PATCHES) ? active_patch : 0];
 }
 
 void StateManager::set_selected_bank(uint8_t bank)
@@ -235,4 +439,14 @@ void StateManager::set_ext_ctrl_b_type(uint8_t type)
 uint8_t StateManager::get_ext_ctrl_b_type(void)
 {
     return this->ext_ctrl_b_type;
+}
+
+uint32_t StateManager::get_bank_cache_hits(void)
+{
+    return bank_cache_hits;
+}
+
+uint32_t StateManager::get_bank_cache_misses(void)
+{
+    return bank_cache_misses;
 }
\ No newline at end of file
@@ -10,6 +10,10 @@
 /* Project Includes */
 #include "gpio_defs.h"
 
+/* Banks kept in RAM in packed form, loaded outwards from the active bank. Enough to hold every EEPROM bank, 
+library banks further away are read from flash as they come into range */
+#define BANK_CACHE_SIZE NUM_BANKS
+
 class StorageManager;
 
 class StateManager
@@ -23,7 +27,21 @@ class StateManager
 
         /* In-Memory storage of all patch data */
         // bank_x bank_array[NUM_BANKS];
-        BANK_DATA_X loaded_bank;
+        uint8_t loaded_slot;
+
+        /* Bank cache, refilled from the idle loop so bank changes do not wait on storage. Output masks are 
+        read on every patch change so they are kept dense, apart from the rest of the switch data */
+        PATCH_PACKED_X bank_cache[BANK_CACHE_SIZE][NUM_PATCHES];
+        uint8_t output_masks[BANK_CACHE_SIZE][NUM_PATCHES];
+        int16_t bank_cache_tag[BANK_CACHE_SIZE];
+
+        /* Bank loading is progressive, one bit per patch */
+        uint8_t bank_loaded[BANK_CACHE_SIZE];
+        uint32_t bank_cache_hits;
+        uint32_t bank_cache_misses;
+
+        /* Titles are not cached, the active one is read into here on demand */
+        char title_buffer[PATCH_TITLE_SIZE + 1];
 
         /* Mode & Patch Info */
         uint8_t prev_mode;
@@ -38,10 +56,21 @@ class StateManager
         uint8_t ext_ctrl_a_type;
         uint8_t ext_ctrl_b_type;
 
+        int8_t find_cached_bank(uint8_t bank);
+        int8_t fill_cache_slot(uint8_t bank);
+        uint8_t bank_distance(int16_t bank);
+        bool load_next_patch(uint8_t slot);
+        void load_patch_now(uint8_t patch);
+
     public:
         void initialise(StorageManager *pStorageManager);
         void load_memory_store(void);
+        void invalidate_bank_cache(void);
+        void invalidate_patch(uint8_t bank, uint8_t patch);
         void load_new_bank(void);
+        void prefetch_banks(void);
+        uint32_t get_bank_cache_hits(void);
+        uint32_t get_bank_cache_misses(void);
         void toggle_single_output_state(uint8_t position);
         void load_output_state(void);
         bool copy_output_state(void);
@@ -63,6 +92,7 @@ class StateManager
         uint8_t get_active_patch(void);
 
         char * get_active_patch_title(void);
+        const PATCH_PACKED_X * get_active_patch_data(void);
 
         void set_selected_bank(uint8_t bank);
         void set_selected_patch(uint8_t);
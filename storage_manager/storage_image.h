@@ -0,0 +1,227 @@
+#ifndef STORAGE_IMAGE_H
+#define STORAGE_IMAGE_H
+
+/* C/C++ Includes */
+#include <array>
+
+/* Project Includes */
+#include "gpio_defs.h"
+#include "storage_schema.h"
+
+/* Default patch titles are PATCH_DEFAULT_TITLE followed by the patch number */
+constexpr char PATCH_DEFAULT_TITLE[] = "New Patch ";
+
+typedef std::array<uint8_t, StorageEeprom::TOTAL_BYTES> EEPROM_IMAGE_X;
+
+/* Describes where the fixed size patch records of older storage layouts live, used to migrate them to the record heap */
+typedef struct storage_layout_x
+{
+    uint8_t  version;
+    uint16_t patch_data_offset;
+    uint16_t patch_data_size;
+    bool     has_crc;
+} STORAGE_LAYOUT_X;
+
+constexpr STORAGE_LAYOUT_X storage_layouts[] =
+{
+    {STORAGE_LAYOUT_LEGACY, 19,                86,              false},
+    {STORAGE_LAYOUT_FIXED,  PATCH_DATA_OFFSET, PATCH_DATA_SIZE, true}
+};
+
+/* CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) */
+constexpr uint16_t crc16(const uint8_t *data, uint16_t length, uint16_t initial = 0xFFFF)
+{
+    uint16_t crc = initial;
+
+    for(uint16_t i = 0; i < length; i++)
+    {
+        crc ^= (uint16_t)(data[i] << 8);
+
+        for(uint8_t bit = 0; bit < 8; bit++)
+        {
+            if(crc & 0x8000)
+            {
+                crc = (uint16_t)((crc << 1) ^ 0x1021);
+            }
+            else
+            {
+                crc = (uint16_t)(crc << 1);
+            }
+        }
+    }
+    return crc;
+}
+
+/* Version and CRC check of a fixed PATCH_DATA_SIZE record, as stored by layout 2 */
+constexpr bool fixed_patch_record_valid(const uint8_t *record)
+{
+    uint16_t crc = crc16(record, PATCH_CRC_OFFSET);
+
+    return (record[PATCH_VERSION_OFFSET] == PATCH_RECORD_VERSION) &&
+           (record[PATCH_CRC_OFFSET]     == (uint8_t)(crc >> 8)) &&
+           (record[PATCH_CRC_OFFSET + 1] == (uint8_t)crc);
+}
+
+/* Size of a variable length record holding a title and MIDI messages of the given lengths */
+constexpr uint8_t patch_record_size(uint8_t title_length, uint8_t num_midi_pc, uint8_t num_midi_cc)
+{
+    return RECORD_HEADER_SIZE + title_length + (num_midi_pc * MIDI_PC_SIZE) + (num_midi_cc * MIDI_CC_SIZE) + RECORD_CRC_SIZE;
+}
+
+/* Stamps the length and CRC into a variable length record whose header, title and MIDI data are filled in */
+constexpr uint8_t seal_patch_record(uint8_t *record)
+{
+    uint8_t length = patch_record_size(record[RECORD_TITLE_LENGTH_OFFSET],
+                                       record[RECORD_NUM_MIDI_OFFSET] & PACKED_NUM_MIDI_PC_MASK,
+                                       record[RECORD_NUM_MIDI_OFFSET] >> PACKED_NUM_MIDI_CC_SHIFT);
+    uint16_t crc = 0;
+
+    record[RECORD_LENGTH_OFFSET] = length;
+    crc = crc16(&record[RECORD_LENGTH_OFFSET], length - RECORD_CRC_SIZE - RECORD_LENGTH_OFFSET);
+    record[length - RECORD_CRC_SIZE]     = (uint8_t)(crc >> 8);
+    record[length - RECORD_CRC_SIZE + 1] = (uint8_t)crc;
+
+    return length;
+}
+
+constexpr bool patch_record_valid(const uint8_t *record)
+{
+    uint8_t title_length = record[RECORD_TITLE_LENGTH_OFFSET];
+    uint8_t num_midi_pc  = record[RECORD_NUM_MIDI_OFFSET] & PACKED_NUM_MIDI_PC_MASK;
+    uint8_t num_midi_cc  = record[RECORD_NUM_MIDI_OFFSET] >> PACKED_NUM_MIDI_CC_SHIFT;
+    uint8_t length       = record[RECORD_LENGTH_OFFSET];
+    uint16_t crc         = 0;
+
+    if((title_length > PATCH_TITLE_SIZE) || (num_midi_pc > PATCH_MAX_MIDI_PC) || (num_midi_cc > PATCH_MAX_MIDI_CC) ||
+       (length != patch_record_size(title_length, num_midi_pc, num_midi_cc)))
+    {
+        return false;
+    }
+
+    crc = crc16(&record[RECORD_LENGTH_OFFSET], length - RECORD_CRC_SIZE - RECORD_LENGTH_OFFSET);
+
+    return (record[length - RECORD_CRC_SIZE]     == (uint8_t)(crc >> 8)) &&
+           (record[length - RECORD_CRC_SIZE + 1] == (uint8_t)crc);
+}
+
+/* Start of the MIDI PC and MIDI CC entries of a variable length record */
+constexpr const uint8_t * record_midi_pc(const uint8_t *record)
+{
+    return &record[RECORD_TITLE_OFFSET + record[RECORD_TITLE_LENGTH_OFFSET]];
+}
+
+constexpr const uint8_t * record_midi_cc(const uint8_t *record)
+{
+    return record_midi_pc(record) + ((record[RECORD_NUM_MIDI_OFFSET] & PACKED_NUM_MIDI_PC_MASK) * MIDI_PC_SIZE);
+}
+
+/* Patch index access on a whole EEPROM image */
+constexpr uint16_t patch_index_entry(const uint8_t *image, uint8_t key)
+{
+    uint16_t address = patch_index_address[key];
+
+    return (uint16_t)((image[address] << 8) | image[address + 1]);
+}
+
+constexpr void set_patch_index_entry(uint8_t *image, uint8_t key, uint16_t record_address)
+{
+    uint16_t address = patch_index_address[key];
+
+    image[address]     = (uint8_t)(record_address >> 8);
+    image[address + 1] = (uint8_t)record_address;
+}
+
+constexpr void seal_patch_index(uint8_t *image)
+{
+    uint16_t crc = crc16(&image[SCHEMA_PATCH_INDEX.address], SCHEMA_PATCH_INDEX.size);
+
+    image[SCHEMA_PATCH_INDEX_CRC.address]     = (uint8_t)(crc >> 8);
+    image[SCHEMA_PATCH_INDEX_CRC.address + 1] = (uint8_t)crc;
+}
+
+constexpr bool patch_index_valid(const uint8_t *image)
+{
+    uint16_t crc = crc16(&image[SCHEMA_PATCH_INDEX.address], SCHEMA_PATCH_INDEX.size);
+
+    return (image[SCHEMA_PATCH_INDEX_CRC.address]     == (uint8_t)(crc >> 8)) &&
+           (image[SCHEMA_PATCH_INDEX_CRC.address + 1] == (uint8_t)crc);
+}
+
+/* Stamps the layout version and CRC into a SYSTEM_INFO_SIZE block */
+constexpr void seal_system_info(uint8_t *system_info)
+{
+    uint16_t crc = 0;
+
+    system_info[LAYOUT_VERSION_OFFSET] = STORAGE_LAYOUT_VERSION;
+    crc = crc16(system_info, SYSTEM_CRC_OFFSET);
+    system_info[SYSTEM_CRC_OFFSET]     = (uint8_t)(crc >> 8);
+    system_info[SYSTEM_CRC_OFFSET + 1] = (uint8_t)crc;
+}
+
+constexpr bool system_info_valid(const uint8_t *system_info)
+{
+    uint16_t crc = crc16(system_info, SYSTEM_CRC_OFFSET);
+
+    return (system_info[SYSTEM_CRC_OFFSET]     == (uint8_t)(crc >> 8)) &&
+           (system_info[SYSTEM_CRC_OFFSET + 1] == (uint8_t)crc);
+}
+
+/****************************************************************
+Function:   make_default_image
+Arguments:  none
+Return:     EEPROM_IMAGE_X
+
+Builds the contents of a freshly formatted EEPROM at compile time:
+boot header, default system info, the patch index and a record
+heap holding a default titled record for each of the TOTAL_PATCHES
+patches, and the boot footer. Everything else is zero.
+****************************************************************/
+constexpr EEPROM_IMAGE_X make_default_image(void)
+{
+    EEPROM_IMAGE_X image{};
+    uint16_t address = SCHEMA_PATCH_HEAP.address;
+    uint8_t *record = nullptr;
+    uint8_t title_length = 0;
+    uint8_t number = 0;
+
+    /* Boot header and footer */
+    for(uint8_t i = 0; i < BOOT_FLAG_SIZE; i++)
+    {
+        image[SCHEMA_BOOT_HEADER.address + i] = (uint8_t)(BOOT_FLAG >> (8 * (BOOT_FLAG_SIZE - 1 - i)));
+        image[SCHEMA_BOOT_FOOTER.address + i] = (uint8_t)(BOOT_FLAG >> (8 * (BOOT_FLAG_SIZE - 1 - i)));
+    }
+
+    /* System info defaults are all zero: Manual mode, momentary ext ctrl, bank 1, patch 1 */
+    seal_system_info(image.data() + SCHEMA_SYSTEM_INFO.address);
+
+    /* Default records: title only, no MIDI messages */
+    for(uint8_t key = 0; key < TOTAL_PATCHES; key++)
+    {
+        record = image.data() + address;
+        title_length = 0;
+
+        for(uint8_t i = 0; PATCH_DEFAULT_TITLE[i] != 0; i++)
+        {
+            record[RECORD_TITLE_OFFSET + title_length++] = PATCH_DEFAULT_TITLE[i];
+        }
+
+        number = key % NUM_PATCHES;
+        if(number >= 10)
+        {
+            record[RECORD_TITLE_OFFSET + title_length++] = '0' + (number / 10);
+        }
+        record[RECORD_TITLE_OFFSET + title_length++] = '0' + (number % 10);
+
+        record[RECORD_KEY_OFFSET]          = key;
+        record[RECORD_TITLE_LENGTH_OFFSET] = title_length;
+
+        set_patch_index_entry(image.data(), key, address);
+        address += seal_patch_record(record);
+    }
+
+    seal_patch_index(image.data());
+
+    return image;
+}
+
+#endif
@@ -10,23 +10,568 @@
 #include "debug.h"
 #include "gpio_defs.h"
 #include "storage_manager.h"
+#include "storage_image.h"
 #include "state_manager.h"
+#include "flash_library.h"
 
-const char* PATCH_DEFAULT_TITLE = "New Patch %d";
+/* Contents of a freshly formatted EEPROM, generated at compile time */
+static constexpr EEPROM_IMAGE_X default_image = make_default_image();
 
 StorageManager::StorageManager(i2c_inst_t *i2c_instance, uint8_t i2c_address)
 {
-    eeprom = CAT24C32(i2c_instance, i2c_address);
+    eeprom = StorageEeprom(i2c_instance, i2c_address);
+    pFlashLibrary = nullptr;
+    image_loaded = false;
+    flush_state = FLUSH_IDLE;
+    journal_head = -1;
+    journal_sequence = 0;
+    heap_end = SCHEMA_PATCH_HEAP.address;
+    compact_state = COMPACT_IDLE;
+    compact_requested = false;
+    last_stage_time_us = 0;
+    flush_held = false;
+    memset(dirty_pages, 0, sizeof(dirty_pages));
 }
 
 void StorageManager::factory_reset(void)
 {
     eeprom.erase();
+    memset(eeprom_image, 0, StorageEeprom::TOTAL_BYTES);
+    memset(committed_image, 0, StorageEeprom::TOTAL_BYTES);
+    memset(dirty_pages, 0, sizeof(dirty_pages));
+    heap_end = SCHEMA_PATCH_HEAP.address;
 }
 
-void StorageManager::initialise(StateManager *pStateManager)
+/****************************************************************
+Function:   load_image
+Arguments:  none
+Return:     void
+
+Streams the entire EEPROM into eeprom_image with one sequential
+read. Once loaded, all reads are served from RAM and every write
+updates the image as well as the device so the two stay coherent.
+****************************************************************/
+void StorageManager::load_image(void)
+{
+    #ifdef DEBUG
+    printf("StorageManager::load_image()\n");
+    #endif
+
+    complete_flush();
+
+    /* The display shares the bus, so there is nothing else to do but wait for the DMA to finish */
+    if(!eeprom.start_read_dma(0, StorageEeprom::TOTAL_BYTES, eeprom_image) || (eeprom.wait_for_transfer() != TRANSFER_DONE))
+    {
+        #ifdef DEBUG
+        printf("StorageManager::load_image() - DMA read failed, reading blocking\n");
+        #endif
+        if(eeprom.read_multiple_bytes(0, StorageEeprom::TOTAL_BYTES, eeprom_image))
+        {
+            #ifdef DEBUG
+            printf("StorageManager::load_image() - Blocking read failed\n");
+            #endif
+        }
+    }
+    memcpy(committed_image, eeprom_image, StorageEeprom::TOTAL_BYTES);
+    memset(dirty_pages, 0, sizeof(dirty_pages));
+    image_loaded = true;
+}
+
+void StorageManager::read_bytes(uint16_t byte_address, uint16_t num_bytes, uint8_t *destination)
+{
+    if(image_loaded)
+    {
+        memcpy(destination, &eeprom_image[byte_address], num_bytes);
+    }
+    else
+    {
+        complete_flush();
+        eeprom.read_multiple_bytes(byte_address, num_bytes, destination);
+    }
+}
+
+/* Immediate write-through to the device, bypassing the write-back cache */
+int StorageManager::write_bytes(uint8_t *source, uint16_t byte_address, uint16_t num_bytes)
+{
+    complete_flush();
+    memcpy(&eeprom_image[byte_address], source, num_bytes);
+    memcpy(&committed_image[byte_address], source, num_bytes);
+    return eeprom.write_multiple_bytes(source, byte_address, num_bytes);
+}
+
+/****************************************************************
+Function:   stage_bytes
+Arguments:  (uint8_t*) source
+            (uint16_t) byte_address
+            (uint16_t) num_bytes
+Return:     void
+
+Updates the RAM image and marks every page touched as dirty. 
+Nothing is sent to the device until flush() is called, so repeated
+updates to the same page are merged into a single page write. Pages
+are written highest first: a new record is appended above the one
+it replaces, which is above the patch index, so the new data always
+reaches the device before anything that refers to it.
+****************************************************************/
+void StorageManager::stage_bytes(uint8_t *source, uint16_t byte_address, uint16_t num_bytes)
+{
+    uint16_t first_page = byte_address / StorageEeprom::PAGE_SIZE;
+    uint16_t last_page  = (byte_address + num_bytes - 1) / StorageEeprom::PAGE_SIZE;
+
+    memcpy(&eeprom_image[byte_address], source, num_bytes);
+
+    for(uint16_t page = first_page; page <= last_page; page++)
+    {
+        dirty_pages[page / 32] |= (1UL << (page % 32));
+    }
+
+    last_stage_time_us = time_us_64();
+}
+
+void StorageManager::stage_byte(uint8_t byte, uint16_t byte_address)
+{
+    stage_bytes(&byte, byte_address, 1);
+}
+
+bool StorageManager::is_dirty(void)
+{
+    for(uint8_t i = 0; i < (StorageEeprom::PAGE_COUNT / 32); i++)
+    {
+        if(dirty_pages[i])
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Finds the span between the first and last byte of a page that differs from the committed image, returns 0 if the page is clean */
+uint8_t StorageManager::changed_span(uint16_t page, uint16_t *first)
+{
+    uint16_t page_address = page * StorageEeprom::PAGE_SIZE;
+    uint16_t start = StorageEeprom::PAGE_SIZE;
+    uint16_t last  = 0;
+
+    for(uint16_t i = 0; i < StorageEeprom::PAGE_SIZE; i++)
+    {
+        if(eeprom_image[page_address + i] != committed_image[page_address + i])
+        {
+            if(start == StorageEeprom::PAGE_SIZE)
+            {
+                start = i;
+            }
+            last = i;
+        }
+    }
+
+    if(start == StorageEeprom::PAGE_SIZE)
+    {
+        return 0;
+    }
+
+    *first = page_address + start;
+    return (last - start) + 1;
+}
+
+/****************************************************************
+Function:   flush_page
+Arguments:  (uint16_t) page
+Return:     uint8_t (0 on success)
+
+Writes back a single dirty page and waits for it. Only the changed
+span is written, as one page transaction, and then read back to 
+verify. A write the device NACKs or times out on is retried up to
+STORAGE_WRITE_ATTEMPTS times. A page which still fails, or fails
+verification, stays dirty so it is retried later.
+****************************************************************/
+uint8_t StorageManager::flush_page(uint16_t page)
+{
+    uint16_t first;
+    uint8_t span = changed_span(page, &first);
+    uint8_t attempt;
+
+    if(span)
+    {
+        for(attempt = 0; attempt < STORAGE_WRITE_ATTEMPTS; attempt++)
+        {
+            if(eeprom.write_page(&eeprom_image[first], first, span) == 0)
+            {
+                break;
+            }
+        }
+
+        if(attempt == STORAGE_WRITE_ATTEMPTS)
+        {
+            #ifdef DEBUG
+            printf("StorageManager::flush_page() - Page %d write failed\n", page);
+            #endif
+            return 1;
+        }
+
+        if(eeprom.read_multiple_bytes(first, span, read_buffer) || memcmp(read_buffer, &eeprom_image[first], span))
+        {
+            #ifdef DEBUG
+            printf("StorageManager::flush_page() - Page %d failed verification\n", page);
+            #endif
+            return 1;
+        }
+
+        memcpy(&committed_image[first], &eeprom_image[first], span);
+    }
+
+    dirty_pages[page / 32] &= ~(1UL << (page % 32));
+    return 0;
+}
+
+/****************************************************************
+Function:   flush_step
+Arguments:  (uint8_t*) result (0, or 1 if a page failed)
+Return:     bool (false if there is nothing to flush)
+
+Advances the non-blocking flush by one step per call: start a DMA 
+page write of the next dirty page, wait for the transfer, then 
+ACK poll the write cycle. The changed span is snapshotted when the
+write starts, so the image may keep changing underneath it; the 
+page only becomes clean once the image matches what was committed.
+****************************************************************/
+bool StorageManager::flush_step(uint8_t *result)
+{
+    TRANSFER_STATUS status;
+
+    *result = 0;
+
+    switch(flush_state)
+    {
+        case FLUSH_IDLE:
+            /* Highest dirty page first, as flush() */
+            for(flush_page_index = StorageEeprom::PAGE_COUNT; flush_page_index > 0; flush_page_index--)
+            {
+                if(dirty_pages[(flush_page_index - 1) / 32] & (1UL << ((flush_page_index - 1) % 32)))
+                {
+                    break;
+                }
+            }
+
+            if(flush_page_index == 0)
+            {
+                return false;
+            }
+            flush_page_index--;
+
+            flush_span = changed_span(flush_page_index, &flush_address);
+            if(flush_span == 0)
+            {
+                dirty_pages[flush_page_index / 32] &= ~(1UL << (flush_page_index % 32));
+                return true;
+            }
+
+            memcpy(flush_buffer, &eeprom_image[flush_address], flush_span);
+            if(!eeprom.start_page_write_dma(flush_buffer, flush_address, flush_span))
+            {
+                *result = 1;
+                return true;
+            }
+            flush_state = FLUSH_WRITING;
+            return true;
+
+        case FLUSH_WRITING:
+            status = eeprom.poll_transfer();
+            if(status == TRANSFER_BUSY)
+            {
+                return true;
+            }
+            if(status != TRANSFER_DONE)
+            {
+                flush_state = FLUSH_IDLE;
+                *result = 1;
+                return true;
+            }
+            flush_state = FLUSH_WRITE_CYCLE;
+            return true;
+
+        case FLUSH_WRITE_CYCLE:
+            status = eeprom.poll_write_cycle();
+            if(status == TRANSFER_BUSY)
+            {
+                return true;
+            }
+            flush_state = FLUSH_IDLE;
+            *result = (status == TRANSFER_DONE) ? finish_flush_page() : 1;
+            return true;
+    }
+
+    return false;
+}
+
+/* Verifies the page written by flush_step() against its snapshot and commits it */
+uint8_t StorageManager::finish_flush_page(void)
+{
+    uint16_t page_address = flush_page_index * StorageEeprom::PAGE_SIZE;
+
+    if(eeprom.read_multiple_bytes(flush_address, flush_span, read_buffer) || memcmp(read_buffer, flush_buffer, flush_span))
+    {
+        #ifdef DEBUG
+        printf("StorageManager::flush_step() - Page %d failed verification\n", flush_page_index);
+        #endif
+        return 1;
+    }
+
+    memcpy(&committed_image[flush_address], flush_buffer, flush_span);
+
+    if(memcmp(&eeprom_image[page_address], &committed_image[page_address], StorageEeprom::PAGE_SIZE) == 0)
+    {
+        dirty_pages[flush_page_index / 32] &= ~(1UL << (flush_page_index % 32));
+    }
+    return 0;
+}
+
+/* Runs an in-flight page write to completion before the EEPROM is used synchronously */
+void StorageManager::complete_flush(void)
+{
+    uint8_t result;
+
+    while(flush_state != FLUSH_IDLE)
+    {
+        flush_step(&result);
+    }
+}
+
+/* Waits for any DMA transfer so the bus can be used by another device, the write cycle is left running */
+void StorageManager::release_bus(void)
+{
+    uint8_t result;
+
+    while(flush_state == FLUSH_WRITING)
+    {
+        flush_step(&result);
+    }
+}
+
+/* Writes back every dirty page highest first, returns non-zero if any page failed verification */
+uint8_t StorageManager::flush(void)
+{
+    return flush_pages(StorageEeprom::PAGE_COUNT - 1, 0);
+}
+
+/* Writes back the dirty pages from first to last inclusive, in descending order if last is below first */
+uint8_t StorageManager::flush_pages(uint16_t first, uint16_t last)
+{
+    int16_t step = (last < first) ? -1 : 1;
+    uint8_t result = 0;
+
+    complete_flush();
+
+    for(uint16_t page = first; ; page += step)
+    {
+        if(dirty_pages[page / 32] & (1UL << (page % 32)))
+        {
+            result |= flush_page(page);
+        }
+
+        if(page == last)
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+
+/* Once no new data has been staged for STORAGE_IDLE_FLUSH_MS, flush one dirty page per call */
+void StorageManager::flush_idle(void)
+{
+    uint8_t result;
+
+    if(!flush_held && is_dirty() && ((time_us_64() - last_stage_time_us) > (STORAGE_IDLE_FLUSH_MS * 1000)))
+    {
+        flush_step(&result);
+    }
+}
+
+/****************************************************************
+Function:   service_idle
+Arguments:  none
+Return:     void
+
+Idle work, one step per call. A compaction under way comes first:
+its pages are flushed straight away, and its next step is staged 
+once they are all committed. Otherwise dirty pages are flushed by
+flush_idle(), and once nothing has been staged for 
+STORAGE_IDLE_FLUSH_MS a requested compaction is started, or the 
+flash library is given a reclaim step. Nothing runs while the 
+flush is held.
+****************************************************************/
+void StorageManager::service_idle(void)
+{
+    uint8_t result;
+
+    if(flush_held)
+    {
+        return;
+    }
+
+    if(compact_state != COMPACT_IDLE)
+    {
+        if(!flush_step(&result))
+        {
+            compact_step();
+        }
+        return;
+    }
+
+    if(is_dirty())
+    {
+        flush_idle();
+        return;
+    }
+
+    if((time_us_64() - last_stage_time_us) <= (STORAGE_IDLE_FLUSH_MS * 1000))
+    {
+        return;
+    }
+
+    if(compact_requested)
+    {
+        start_compaction();
+    }
+    else if(pFlashLibrary != nullptr)
+    {
+        pFlashLibrary->reclaim_step();
+    }
+}
+
+/* Takes the next job to run. A job deferred for a compaction goes first, once the compaction has finished */
+bool StorageManager::next_job(void)
+{
+    if(job_deferred)
+    {
+        return compact_state == COMPACT_IDLE;
+    }
+    return queue_try_remove(&job_queue, &active_job);
+}
+
+/* Holds back the idle flush and queued jobs, staged data is then only written by an explicit flush() */
+void StorageManager::hold_flush(bool hold)
+{
+    flush_held = hold;
+}
+
+/****************************************************************
+Function:   queue_patch_switch_data
+Arguments:  (uint8_t) bank
+            (uint8_t) patch
+            (uint8_t) output_mask
+Return:     bool (false if the job queue is full)
+
+Queues a save of a patch's switch data. The values are captured 
+now, so the state may keep changing while the job waits to run.
+****************************************************************/
+bool StorageManager::queue_patch_switch_data(uint8_t bank, uint8_t patch, uint8_t output_mask)
+{
+    STORAGE_JOB_X job;
+
+    job.job_code    = STORAGE_JOB_SWITCH_DATA;
+    job.bank        = bank;
+    job.patch       = patch;
+    job.output_mask = output_mask;
+
+    return queue_try_add(&job_queue, &job);
+}
+
+/****************************************************************
+Function:   service
+Arguments:  none
+Return:     void
+
+Runs queued storage jobs from idle time on core 0, at most one 
+page write per call so input handling is never held up for more 
+than a single write cycle. When a job's pages have all been 
+written its result is posted to result_queue as a STORAGE_RESULT
+item for the InstructionHandler. The queue is shared with core 1's
+input events, so a result which does not fit is kept and posted 
+again on the next call, before another job starts. Jobs wait in 
+the queue while the flush is held. A save to a library bank is one
+flash page program, and with no job to run service_idle() takes a
+step of the idle work. A save which finds the heap full is run 
+again once a compaction has made room, and only reported as failed
+if it still does not fit.
+****************************************************************/
+void StorageManager::service(void)
+{
+    uint8_t result;
+
+    if(result_pending)
+    {
+        if(!queue_try_add(result_queue, &result_item))
+        {
+            return;
+        }
+        result_pending = false;
+    }
+
+    if(!job_active)
+    {
+        if(flush_held || !next_job())
+        {
+            service_idle();
+            return;
+        }
+
+        job_result = 0;
+
+        switch(active_job.job_code)
+        {
+            case STORAGE_JOB_SWITCH_DATA:
+                job_result = write_patch_output_mask(active_job.bank, active_job.patch, active_job.output_mask);
+                //TODO:ext ctrl
+                break;
+            default:
+                break;
+        }
+
+        if((job_result == STORAGE_HEAP_FULL) && !job_deferred)
+        {
+            job_deferred = true;
+            start_compaction();
+            return;
+        }
+
+        job_deferred = false;
+        job_active = true;
+        return;
+    }
+
+    if(flush_step(&result))
+    {
+        /* Report a failed page rather than spinning on it, the idle flush will retry it */
+        if(result == 0)
+        {
+            return;
+        }
+        job_result = result;
+    }
+
+    result_item.instruction_code = STORAGE_RESULT;
+    result_item.data[0] = active_job.job_code;
+    result_item.data[1] = job_result;
+    result_item.data[2] = active_job.bank;
+    result_item.data[3] = active_job.patch;
+
+    result_pending = !queue_try_add(result_queue, &result_item);
+
+    job_active = false;
+}
+
+void StorageManager::initialise(StateManager *pStateManager, FlashLibrary *pFlashLibrary, queue_t *result_queue)
 {
     this->pStateManager = pStateManager;
+    this->pFlashLibrary = pFlashLibrary;
+    this->result_queue  = result_queue;
+
+    queue_init(&job_queue, sizeof(STORAGE_JOB_X), STORAGE_JOB_QUEUE_LENGTH);
+    job_active = false;
+    job_deferred = false;
+    result_pending = false;
 }
 
 void StorageManager::read_system_data(void)
@@ -35,10 +580,21 @@ void StorageManager::read_system_data(void)
     printf("StorageManager::read_system_data()\n");
     #endif
 
-    eeprom.read_multiple_bytes(SYSTEM_INFO_OFFSET, SYSTEM_INFO_SIZE, read_buffer);
+    read_bytes(SCHEMA_SYSTEM_INFO.address, SCHEMA_SYSTEM_INFO.size, read_buffer);
+
+    /* The newest journal record supersedes the fixed system info cells */
+    if(journal_head >= 0)
+    {
+        uint8_t *record = &eeprom_image[journal_slot_address[journal_head]];
+
+        read_buffer[FLAGS_OFFSET]      = record[JOURNAL_FLAGS_OFFSET];
+        read_buffer[LAST_BANK_OFFSET]  = record[JOURNAL_BANK_OFFSET];
+        read_buffer[LAST_PATCH_OFFSET] = record[JOURNAL_PATCH_OFFSET];
+    }
 
     #ifdef DEBUG
     printf(" - Read EEPROM\n");
+    printf(" - Journal Head: %d, Sequence: %d\n", journal_head, journal_sequence);
     fflush(stdout);
     #endif
 
@@ -60,441 +616,1338 @@ void StorageManager::read_system_data(void)
 }
 
 
-BANK_DATA_X StorageManager::read_bank(uint8_t bank)
-{
-    #ifdef DEBUG
-    printf("StorageManager::read_bank()\n");
-    #endif
+/* Decodes all five patches of a bank straight into the caller's storage */
+void StorageManager::read_bank(uint8_t bank, BANK_DATA_X *destination)
+{
+    #ifdef DEBUG
+    printf("StorageManager::read_bank()\n");
+    #endif
+
+    for(uint8_t patch = 0; patch < NUM_PATCHES; patch++)
+    {
+        read_patch(bank, patch, &destination->patch_array[patch]);
+    }
+}
+
+void StorageManager::read_patch(uint8_t bank, uint8_t patch, PATCH_DATA_X *destination)
+{
+    #ifdef DEBUG
+    printf("StorageManager::read_patch()\n");
+    printf(" -Reading Bank %d, Patch %d\n", bank, patch);
+    #endif
+
+    const uint8_t *record = preset_record(bank, patch);
+
+    if(record == nullptr)
+    {
+        memset(destination, 0, sizeof(PATCH_DATA_X));
+        return;
+    }
+
+    decode_patch(record, destination);
+}
+
+/****************************************************************
+Function:   patch_record
+Arguments:  (uint8_t) bank
+            (uint8_t) patch
+Return:     const uint8_t* (nullptr if the patch has no record)
+
+Read-only view of a variable length patch record in the RAM image,
+laid out as per the RECORD_ offsets in gpio_defs.h, found with one
+index lookup. Valid until the next write to any patch, as records
+move when the heap is compacted. This is the EEPROM tier only, as 
+backed up and restored by key, see preset_record() for the banks 
+the pedal navigates.
+****************************************************************/
+const uint8_t * StorageManager::patch_record(uint8_t bank, uint8_t patch)
+{
+    uint16_t address;
+
+    if(!image_loaded || (bank >= STORAGE_MAX_BANKS) || (patch >= NUM_PATCHES))
+    {
+        return nullptr;
+    }
+
+    address = patch_index_entry(eeprom_image, patch_key(bank, patch));
+
+    if(address == PATCH_INDEX_EMPTY)
+    {
+        return nullptr;
+    }
+    return &eeprom_image[address];
+}
+
+/****************************************************************
+Function:   preset_record
+Arguments:  (uint8_t) bank (0 to TOTAL_BANKS - 1)
+            (uint8_t) patch
+Return:     const uint8_t* (nullptr if the patch has no record)
+
+View of the record of a navigable bank. The first NUM_BANKS banks
+are read from the EEPROM image, the rest from the flash library 
+through XIP. Both tiers store the same variable length record, so
+callers decode either the same way.
+****************************************************************/
+const uint8_t * StorageManager::preset_record(uint8_t bank, uint8_t patch)
+{
+    if(bank < NUM_BANKS)
+    {
+        return patch_record(bank, patch);
+    }
+
+    if((pFlashLibrary == nullptr) || (bank >= TOTAL_BANKS))
+    {
+        return nullptr;
+    }
+    return pFlashLibrary->patch_record(bank - NUM_BANKS, patch);
+}
+
+/****************************************************************
+Function:   read_patch_packed
+Arguments:  (uint8_t) bank
+            (uint8_t) patch
+            (PATCH_PACKED_X*) destination
+Return:     uint8_t (the patch's output mask)
+
+Copies the switch data of a patch, everything but the title, into
+the compact in-RAM form. The output mask is returned separately so
+the caller can keep it in a dense array.
+****************************************************************/
+uint8_t StorageManager::read_patch_packed(uint8_t bank, uint8_t patch, PATCH_PACKED_X *destination)
+{
+    const uint8_t *record = preset_record(bank, patch);
+
+    if(record == nullptr)
+    {
+        memset(destination, 0, sizeof(PATCH_PACKED_X));
+        return 0;
+    }
+    return pack_patch(record, destination);
+}
+
+/* Copies a record's switch data into a PATCH_PACKED_X, unused MIDI slots are zeroed */
+uint8_t StorageManager::pack_patch(const uint8_t *source, PATCH_PACKED_X *destination)
+{
+    uint8_t num_midi = source[RECORD_NUM_MIDI_OFFSET];
+
+    destination->ctrl_flags = source[RECORD_CTRL_FLAGS_OFFSET];
+    destination->num_midi   = num_midi;
+
+    memset(destination->midi_pc, 0, PATCH_MIDI_PC_DATA_SIZE);
+    memset(destination->midi_cc, 0, PATCH_MIDI_CC_DATA_SIZE);
+    memcpy(destination->midi_pc, record_midi_pc(source), (num_midi & PACKED_NUM_MIDI_PC_MASK) * MIDI_PC_SIZE);
+    memcpy(destination->midi_cc, record_midi_cc(source), (num_midi >> PACKED_NUM_MIDI_CC_SHIFT) * MIDI_CC_SIZE);
+
+    return source[RECORD_OUTPUT_MASK_OFFSET];
+}
+
+/* Copies a patch title, null terminated, into title (at least PATCH_TITLE_SIZE + 1 bytes) */
+void StorageManager::read_patch_title(uint8_t bank, uint8_t patch, char *title)
+{
+    const uint8_t *record = preset_record(bank, patch);
+    uint8_t title_length = 0;
+
+    if(record != nullptr)
+    {
+        title_length = record[RECORD_TITLE_LENGTH_OFFSET];
+        memcpy(title, &record[RECORD_TITLE_OFFSET], title_length);
+    }
+    title[title_length] = 0;
+}
+
+/* Unpacks a variable length record laid out as per the RECORD_ offsets in gpio_defs.h */
+void StorageManager::decode_patch(const uint8_t *source, PATCH_DATA_X *destination)
+{
+    uint8_t ctrl_flags = source[RECORD_CTRL_FLAGS_OFFSET];
+    uint8_t title_length = source[RECORD_TITLE_LENGTH_OFFSET];
+    const uint8_t *midi_pc = record_midi_pc(source);
+    const uint8_t *midi_cc = record_midi_cc(source);
+
+    /* Title */
+    memset(destination->title, 0, sizeof(destination->title));
+    memcpy(destination->title, &source[RECORD_TITLE_OFFSET], title_length);
+
+    /* General Data */
+    destination->amp_ctrl_a_enable = (ctrl_flags & PATCH_AMP_A_ENABLE_MASK);
+    destination->amp_ctrl_a_value  = (ctrl_flags & PATCH_AMP_A_VALUE_MASK);
+    destination->amp_ctrl_b_enable = (ctrl_flags & PATCH_AMP_B_ENABLE_MASK);
+    destination->amp_ctrl_b_value  = (ctrl_flags & PATCH_AMP_B_VALUE_MASK);
+    destination->ext_ctrl_a_enable = (ctrl_flags & PATCH_EXT_CTRL_A_ENABLE_MASK);
+    destination->ext_ctrl_a_value  = (ctrl_flags & PATCH_EXT_CTRL_A_VALUE_MASK);
+    destination->ext_ctrl_b_enable = (ctrl_flags & PATCH_EXT_CTRL_B_ENABLE_MASK);
+    destination->ext_ctrl_b_value  = (ctrl_flags & PATCH_EXT_CTRL_B_VALUE_MASK);
+
+    /* MIDI counts were range checked against the record length when the record was validated */
+    destination->output_mask       = source[RECORD_OUTPUT_MASK_OFFSET];
+    destination->num_midi_pc       = source[RECORD_NUM_MIDI_OFFSET] & PACKED_NUM_MIDI_PC_MASK;
+    destination->num_midi_cc       = source[RECORD_NUM_MIDI_OFFSET] >> PACKED_NUM_MIDI_CC_SHIFT;
+
+    /* MIDI Program Changes */
+    for(int i = 0; i < destination->num_midi_pc; i++)
+    {
+        destination->midi_program_changes[i].channel = midi_pc[0];
+        destination->midi_program_changes[i].data    = midi_pc[1];
+        midi_pc+= MIDI_PC_SIZE;
+    }
+
+    /* MIDI Control Changes */
+    for(int i = 0; i < destination->num_midi_cc; i++)
+    {
+        destination->midi_control_changes[i].channel    = midi_cc[0];
+        destination->midi_control_changes[i].controller = midi_cc[1];
+        destination->midi_control_changes[i].value      = midi_cc[2];
+        midi_cc+= MIDI_CC_SIZE;
+    }
+}
+
+/****************************************************************
+Function:   scan_journal
+Arguments:  none
+Return:     void
+
+Finds the newest valid record in the system state journal with a
+single pass over the RAM image. Sequence numbers are compared with
+serial arithmetic so the search survives the 16 bit counter wrapping.
+****************************************************************/
+void StorageManager::scan_journal(void)
+{
+    uint8_t *record;
+    uint16_t sequence;
+
+    journal_head = -1;
+    journal_sequence = 0;
+
+    for(int16_t slot = 0; slot < JOURNAL_RECORD_COUNT; slot++)
+    {
+        record = &eeprom_image[journal_slot_address[slot]];
+
+        if(record[JOURNAL_CHECK_OFFSET] != journal_check(record))
+        {
+            continue;
+        }
+
+        sequence = (record[JOURNAL_SEQUENCE_OFFSET] << 8) | record[JOURNAL_SEQUENCE_OFFSET + 1];
+
+        if((journal_head < 0) || ((int16_t)(sequence - journal_sequence) > 0))
+        {
+            journal_head = slot;
+            journal_sequence = sequence;
+        }
+    }
+}
+
+/* Check byte is the inverted XOR of the record, so erased (all 0x00 or 0xFF) slots never validate */
+uint8_t StorageManager::journal_check(uint8_t *record)
+{
+    uint8_t check = 0;
+
+    for(uint8_t i = 0; i < JOURNAL_CHECK_OFFSET; i++)
+    {
+        check ^= record[i];
+    }
+    return ~check;
+}
+
+/****************************************************************
+Function:   append_journal
+Arguments:  (uint8_t) flags
+            (uint8_t) bank
+            (uint8_t) patch
+Return:     void
+
+Stages a new record in the slot after the current head. Nothing is 
+written if the state matches the newest record. Successive appends 
+move through the whole journal region, so no single cell takes 
+every update, and several appends to one page are coalesced by the 
+write-back cache into a single page write.
+****************************************************************/
+void StorageManager::append_journal(uint8_t flags, uint8_t bank, uint8_t patch)
+{
+    uint8_t record[JOURNAL_RECORD_SIZE];
+    uint8_t *head;
+    int16_t slot;
+
+    if(journal_head >= 0)
+    {
+        head = &eeprom_image[journal_slot_address[journal_head]];
+
+        if((head[JOURNAL_FLAGS_OFFSET] == flags) && (head[JOURNAL_BANK_OFFSET] == bank) && (head[JOURNAL_PATCH_OFFSET] == patch))
+        {
+            return;
+        }
+    }
+
+    slot = (journal_head + 1) % JOURNAL_RECORD_COUNT;
+    journal_sequence++;
+
+    memset(record, 0, JOURNAL_RECORD_SIZE);
+    record[JOURNAL_SEQUENCE_OFFSET]     = (uint8_t)(journal_sequence >> 8);
+    record[JOURNAL_SEQUENCE_OFFSET + 1] = (uint8_t)journal_sequence;
+    record[JOURNAL_FLAGS_OFFSET]        = flags;
+    record[JOURNAL_BANK_OFFSET]         = bank;
+    record[JOURNAL_PATCH_OFFSET]        = patch;
+    record[JOURNAL_CHECK_OFFSET]        = journal_check(record);
+
+    stage_bytes(record, journal_slot_address[slot], JOURNAL_RECORD_SIZE);
+    journal_head = slot;
+}
+
+/* Fetches the current flags/bank/patch, from the journal head if there is one, otherwise the fixed system info */
+void StorageManager::read_journal_state(uint8_t *flags, uint8_t *bank, uint8_t *patch)
+{
+    uint8_t *record;
+
+    if(journal_head >= 0)
+    {
+        record = &eeprom_image[journal_slot_address[journal_head]];
+        *flags = record[JOURNAL_FLAGS_OFFSET];
+        *bank  = record[JOURNAL_BANK_OFFSET];
+        *patch = record[JOURNAL_PATCH_OFFSET];
+    }
+    else
+    {
+        *flags = eeprom_image[SCHEMA_SYSTEM_FLAGS.address];
+        *bank  = eeprom_image[SCHEMA_LAST_BANK.address];
+        *patch = eeprom_image[SCHEMA_LAST_PATCH.address];
+    }
+}
+
+uint8_t StorageManager::write_active_bank(uint8_t bank)
+{
+    uint8_t flags, last_bank, last_patch;
+
+    read_journal_state(&flags, &last_bank, &last_patch);
+    append_journal(flags, bank, last_patch);
+    return 0;
+}
+
+uint8_t StorageManager::write_active_patch(uint8_t patch)
+{
+    uint8_t flags, last_bank, last_patch;
+
+    read_journal_state(&flags, &last_bank, &last_patch);
+    append_journal(flags, last_bank, patch);
+    return 0;
+}
+
+uint8_t StorageManager::write_system_flags(uint8_t mode, uint8_t ctrl_a, uint8_t ctrl_b)
+{
+    uint8_t mask = 0;
+
+    mask |= mode;
+    mask |= ctrl_a << 1;
+    mask |= ctrl_b << 2;
+
+    stage_byte(mask, SCHEMA_SYSTEM_FLAGS.address);
+    seal_system_info_block();
+
+    /* Keep the journal head in step, otherwise it would override the new flags on the next boot */
+    if(journal_head >= 0)
+    {
+        uint8_t flags, last_bank, last_patch;
+
+        read_journal_state(&flags, &last_bank, &last_patch);
+        append_journal(mask, last_bank, last_patch);
+    }
+    return 0;
+}
+
+uint8_t StorageManager::write_patch_title(uint8_t bank, uint8_t patch, uint8_t* title)
+{
+    uint8_t title_length = 0;
+    uint8_t old_length;
+    uint16_t midi_size;
+
+    #ifdef DEBUG
+    printf("StorageManager::write_patch_title() - Bank: %d, Patch: %d\n", bank, patch);
+    #endif
+
+    if(load_record_buffer(bank, patch))
+    {
+        return 1;
+    }
+
+    while((title_length < PATCH_TITLE_SIZE) && (title[title_length] != 0))
+    {
+        title_length++;
+    }
+
+    /* Shift the MIDI data to follow the new title, the record length changes with it */
+    old_length = patch_buffer[RECORD_TITLE_LENGTH_OFFSET];
+    midi_size  = patch_buffer[RECORD_LENGTH_OFFSET] - RECORD_HEADER_SIZE - old_length - RECORD_CRC_SIZE;
+    memmove(&patch_buffer[RECORD_TITLE_OFFSET + title_length], &patch_buffer[RECORD_TITLE_OFFSET + old_length], midi_size);
+    memcpy(&patch_buffer[RECORD_TITLE_OFFSET], title, title_length);
+    patch_buffer[RECORD_TITLE_LENGTH_OFFSET] = title_length;
+
+    return store_preset(bank, patch);
+}
+
+uint8_t StorageManager::write_patch_switch_data(void)
+{
+    write_patch_output_mask();
+    //TODO:ext ctrl
+
+    /* Commit the preset now rather than waiting for idle, so the result can be reported */
+    return flush();
+}
+
+uint8_t StorageManager::write_patch_output_mask(void)
+{
+    return write_patch_output_mask(pStateManager->get_active_bank(), pStateManager->get_write_location(), pStateManager->get_output_mask());
+}
+
+uint8_t StorageManager::write_patch_output_mask(uint8_t bank, uint8_t patch, uint8_t output_mask)
+{
+    #ifdef DEBUG
+    printf("StorageManager::write_patch_output_mask()\n");
+    printf(" - Bank: %d, Patch: %d, Mask: %02x\n", bank, patch, output_mask);
+    #endif
+
+    if(load_record_buffer(bank, patch))
+    {
+        return 1;
+    }
+
+    patch_buffer[RECORD_OUTPUT_MASK_OFFSET] = output_mask;
+
+    return store_preset(bank, patch);
+}
+
+uint8_t StorageManager::validate_eeprom(void)
+{
+    bool header_not_found;
+    bool footer_not_found;
+    int result = 0;
+    uint8_t layout_version;
+    uint8_t repaired;
+
+    /* Shadow the whole device in RAM, all checks and reads from here on are served from the image */
+    load_image();
+
+    /* Check the first and last 4 bytes of EEPROM for the boot flag */
+    header_not_found = memcmp(&eeprom_image[SCHEMA_BOOT_HEADER.address], &default_image[SCHEMA_BOOT_HEADER.address], SCHEMA_BOOT_HEADER.size);
+    footer_not_found = memcmp(&eeprom_image[SCHEMA_BOOT_FOOTER.address], &default_image[SCHEMA_BOOT_FOOTER.address], SCHEMA_BOOT_FOOTER.size);
+
+    #ifdef DEBUG
+    printf("Checking Boot Header:\n");
+    print_buff(&eeprom_image[SCHEMA_BOOT_HEADER.address], SCHEMA_BOOT_HEADER.size);
+    printf("Header Result: %d\n", header_not_found);
+    printf("Checking Boot Footer:\n");
+    print_buff(&eeprom_image[SCHEMA_BOOT_FOOTER.address], SCHEMA_BOOT_FOOTER.size);
+    printf("Footer Result %d\n", footer_not_found);
+    fflush(stdout);
+    #endif
+
+    if(header_not_found || footer_not_found)
+    {
+        // TODO: maybe put something in here to inform that the pedal is doing some "setup" or whatever
+        
+        #ifdef DEBUG
+        printf("First Boot!\n");
+        printf("Formatting...\n");
+        #endif
+
+        result = format();
+
+        #ifdef DEBUG
+        printf("Format Result: %d\n", result);
+        printf("Write Cycles: %lu, Last: %luus, Max: %luus, Timeouts: %lu\n", eeprom.get_write_count(), eeprom.get_last_write_time_us(), eeprom.get_max_write_time_us(), eeprom.get_write_timeouts());
+        #endif
+    }
+    else
+    {
+        #ifdef DEBUG
+        printf("Boot Flags Detected, Checking Layout\n");
+        #endif
+
+        layout_version = eeprom_image[SCHEMA_LAYOUT_VERSION.address];
+
+        if(layout_version == 0)
+        {
+            layout_version = STORAGE_LAYOUT_LEGACY;
+        }
+
+        /* A layout from newer firmware cannot be interpreted, so start again from defaults */
+        if(layout_version > STORAGE_LAYOUT_VERSION)
+        {
+            result = format();
+        }
+        else if(layout_version < STORAGE_LAYOUT_VERSION)
+        {
+            result = migrate(layout_version);
+        }
+
+        repaired = validate_records();
+
+        /* The main loop is not running yet, so a heap too full for a default record is compacted here and checked again */
+        if(compact_requested)
+        {
+            compact();
+            repaired += validate_records();
+        }
+
+        #ifdef DEBUG
+        printf("Layout Version: %d, Records Repaired: %d\n", layout_version, repaired);
+        #endif
+
+        if(is_dirty())
+        {
+            result |= flush();
+        }
+    }
+
+    scan_journal();
+
+    return result;
+}
+
+/****************************************************************
+Function:   format
+Arguments:  none
+Return:     uint8_t (0 on success)
+
+Brings the device in line with the compile time default image.
+Only pages which differ from what is already on the device are 
+written, in ascending order so the footer page is committed last 
+and an interrupted format is detected on the next boot.
+****************************************************************/
+uint8_t StorageManager::format(void)
+{
+    for(uint16_t page = 0; page < StorageEeprom::PAGE_COUNT; page++)
+    {
+        uint16_t page_address = page * StorageEeprom::PAGE_SIZE;
+
+        if(memcmp(&committed_image[page_address], &default_image[page_address], StorageEeprom::PAGE_SIZE))
+        {
+            stage_bytes((uint8_t *)&default_image[page_address], page_address, StorageEeprom::PAGE_SIZE);
+        }
+        else
+        {
+            memcpy(&eeprom_image[page_address], &committed_image[page_address], StorageEeprom::PAGE_SIZE);
+        }
+    }
+
+    scan_heap();
+    return flush_pages(0, StorageEeprom::PAGE_COUNT - 1);
+}
+
+/* Read-only view of the whole RAM image, including changes not yet flushed */
+const uint8_t * StorageManager::get_image(void)
+{
+    if(!image_loaded)
+    {
+        return nullptr;
+    }
+    return eeprom_image;
+}
+
+/****************************************************************
+Function:   restore_image
+Arguments:  (const uint8_t*) image
+Return:     uint8_t (0 on success, 1 if the image was rejected)
+
+Replaces the RAM image with a complete image from a backup. The 
+boot flags, layout version, system info and patch index must all
+check out before anything is touched. The image is merged through
+the write-back cache, so only pages which differ from the device 
+are marked dirty, and records failing their CRC are repaired as at
+boot. The caller flushes.
+****************************************************************/
+uint8_t StorageManager::restore_image(const uint8_t *image)
+{
+    if(!image_loaded ||
+       memcmp(&image[SCHEMA_BOOT_HEADER.address], &default_image[SCHEMA_BOOT_HEADER.address], SCHEMA_BOOT_HEADER.size) ||
+       memcmp(&image[SCHEMA_BOOT_FOOTER.address], &default_image[SCHEMA_BOOT_FOOTER.address], SCHEMA_BOOT_FOOTER.size) ||
+       (image[SCHEMA_LAYOUT_VERSION.address] != STORAGE_LAYOUT_VERSION) ||
+       !system_info_valid(&image[SCHEMA_SYSTEM_INFO.address]) || !patch_index_valid(image))
+    {
+        #ifdef DEBUG
+        printf("StorageManager::restore_image() - Image rejected\n");
+        #endif
+        return 1;
+    }
+
+    /* A compaction under way was working from the old heap */
+    compact_state = COMPACT_IDLE;
+
+    memcpy(eeprom_image, image, StorageEeprom::TOTAL_BYTES);
+    stage_changed_pages();
+    validate_records();
+    scan_journal();
+
+    return 0;
+}
+
+/* Stages a single record from a backup as the record of the patch its key names */
+uint8_t StorageManager::restore_record(const uint8_t *record, uint16_t length)
+{
+    if(!image_loaded || (length < patch_record_size(0, 0, 0)) || (length > PATCH_RECORD_MAX_SIZE) ||
+       (record[RECORD_LENGTH_OFFSET] != length) || (record[RECORD_KEY_OFFSET] >= PATCH_INDEX_ENTRIES) ||
+       !patch_record_valid(record))
+    {
+        return 1;
+    }
+
+    memcpy(patch_buffer, record, length);
+    return store_record(record[RECORD_KEY_OFFSET]);
+}
+
+/* Copies the system info block with the journal state folded in and resealed, as it would read after a restore */
+void StorageManager::read_system_block(uint8_t *destination)
+{
+    memcpy(destination, &eeprom_image[SCHEMA_SYSTEM_INFO.address], SCHEMA_SYSTEM_INFO.size);
+    read_journal_state(&destination[FLAGS_OFFSET], &destination[LAST_BANK_OFFSET], &destination[LAST_PATCH_OFFSET]);
+    seal_system_info(destination);
+}
+
+/* Stages a system info block from a backup, the journal is moved on with it so the new state wins at the next boot */
+uint8_t StorageManager::restore_system_block(const uint8_t *source)
+{
+    if(!image_loaded || !system_info_valid(source) || (source[LAYOUT_VERSION_OFFSET] != STORAGE_LAYOUT_VERSION))
+    {
+        return 1;
+    }
+
+    stage_bytes((uint8_t *)source, SCHEMA_SYSTEM_INFO.address, SCHEMA_SYSTEM_INFO.size);
+
+    if(journal_head >= 0)
+    {
+        append_journal(source[FLAGS_OFFSET], source[LAST_BANK_OFFSET], source[LAST_PATCH_OFFSET]);
+    }
+    return 0;
+}
+
+/* Copies a patch's record, from either tier, into patch_buffer for editing, or an empty record if it has none */
+uint8_t StorageManager::load_record_buffer(uint8_t bank, uint8_t patch)
+{
+    const uint8_t *record = nullptr;
+
+    if(!image_loaded || (bank >= TOTAL_BANKS) || (patch >= NUM_PATCHES))
+    {
+        return 1;
+    }
+
+    record = preset_record(bank, patch);
+
+    if(record != nullptr)
+    {
+        memcpy(patch_buffer, record, record[RECORD_LENGTH_OFFSET]);
+    }
+    else
+    {
+        memset(patch_buffer, 0, RECORD_HEADER_SIZE);
+        patch_buffer[RECORD_LENGTH_OFFSET] = patch_record_size(0, 0, 0);
+    }
+    return 0;
+}
 
-    BANK_DATA_X read_bank;
+/* Stores patch_buffer as the record of a navigable bank. A library bank is written straight away with one flash page program, 
+its sector erases wait for service_idle(), which a library save also holds off */
+uint8_t StorageManager::store_preset(uint8_t bank, uint8_t patch)
+{
+    if(bank < NUM_BANKS)
+    {
+        return store_record(patch_key(bank, patch));
+    }
 
-    read_bank.patch_array[0] = read_patch(bank, 0);
-    read_bank.patch_array[1] = read_patch(bank, 1);
-    read_bank.patch_array[2] = read_patch(bank, 2);
-    read_bank.patch_array[3] = read_patch(bank, 3);
-    read_bank.patch_array[4] = read_patch(bank, 4);
+    if(pFlashLibrary == nullptr)
+    {
+        return 1;
+    }
 
-    return read_bank;
+    seal_patch_record(patch_buffer);
+    last_stage_time_us = time_us_64();
+    return pFlashLibrary->write_patch(bank - NUM_BANKS, patch, patch_buffer);
 }
 
-PATCH_DATA_X StorageManager::read_patch(uint8_t bank, uint8_t patch)
+/****************************************************************
+Function:   store_record
+Arguments:  (uint8_t) key
+Return:     uint8_t (0 on success, STORAGE_HEAP_FULL if the record
+            does not fit)
+
+Seals the record in patch_buffer and stages it as the record of
+index entry key. It is always appended to the heap, then the old 
+record is marked dead and the index entry updated, so the old copy 
+stays valid until the new one is committed. Rewriting in place 
+would not be safe: a page write torn by a reset leaves a mix of old
+and new bytes, and the patch would fail its CRC and be lost. The 
+heap is never compacted here, as that takes many write cycles: a 
+record which does not fit is refused and a compaction requested 
+from idle, as it is once the heap runs low.
+****************************************************************/
+uint8_t StorageManager::store_record(uint8_t key)
 {
-    #ifdef DEBUG
-    printf("StorageManager::read_patch()\n");
-    #endif
+    uint16_t old_address = patch_index_entry(eeprom_image, key);
+    uint8_t length;
 
-    PATCH_DATA_X   read_patch;
-    uint16_t offset;
-    uint16_t location = PATCH_DATA_OFFSET + (BANK_DATA_SIZE * bank) + (PATCH_DATA_SIZE * patch);
+    patch_buffer[RECORD_KEY_OFFSET] = key;
+    length = seal_patch_record(patch_buffer);
 
-    #ifdef DEBUG
-    printf(" -Reading Bank %d, Patch %d\n", bank, patch);
-    #endif
+    if((heap_end + length) > SCHEMA_PATCH_HEAP.end())
+    {
+        #ifdef DEBUG
+        printf("StorageManager::store_record() - Heap full, %d bytes needed\n", length);
+        #endif
+        compact_requested = true;
+        return STORAGE_HEAP_FULL;
+    }
 
-    /* Title */
-    #ifdef DEBUG
-    printf(" - Reading Title\n");
-    #endif
-    eeprom.read_multiple_bytes(location, PATCH_TITLE_SIZE, read_buffer);
-    memcpy(&read_patch.title, read_buffer, PATCH_TITLE_SIZE);
-    memset(read_buffer, 0, sizeof(read_buffer));
+    stage_bytes(patch_buffer, heap_end, length);
 
-    #ifdef DEBUG
-    printf(" - Reading General\n");
-    #endif
+    if(old_address != PATCH_INDEX_EMPTY)
+    {
+        stage_byte(RECORD_KEY_DEAD, old_address + RECORD_KEY_OFFSET);
+    }
 
-    /* General Data */
-    location+= PATCH_GENERAL_OFFSET;
-    eeprom.read_multiple_bytes(location, PATCH_GENERAL_SIZE, read_buffer);
+    set_index_entry(key, heap_end);
+    heap_end += length;
 
-    read_patch.amp_ctrl_a_enable = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_AMP_A_ENABLE_MASK);
-    read_patch.amp_ctrl_a_value  = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_AMP_A_VALUE_MASK);
-    read_patch.amp_ctrl_b_enable = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_AMP_B_ENABLE_MASK);
-    read_patch.amp_ctrl_b_value  = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_AMP_B_VALUE_MASK);
-    read_patch.ext_ctrl_a_enable = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_EXT_CTRL_A_ENABLE_MASK);
-    read_patch.ext_ctrl_a_value  = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_EXT_CTRL_A_VALUE_MASK);
-    read_patch.ext_ctrl_b_enable = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_EXT_CTRL_B_ENABLE_MASK);
-    read_patch.ext_ctrl_b_value  = (read_buffer[PATCH_CTRL_FLAGS_OFFSET] & PATCH_EXT_CTRL_B_VALUE_MASK);
+    if(get_heap_free() < PATCH_RECORD_MAX_SIZE)
+    {
+        compact_requested = true;
+    }
 
-    read_patch.output_mask       = read_buffer[OUTPUT_BITMASK_OFFSET];
-    read_patch.num_midi_pc       = read_buffer[PATCH_NUM_MIDI_PC_OFFSET];
-    read_patch.num_midi_cc       = read_buffer[PATCH_NUM_MIDI_CC_OFFSET];
+    return 0;
+}
 
+/* Stages a new patch index entry and the index CRC */
+void StorageManager::set_index_entry(uint8_t key, uint16_t address)
+{
+    uint8_t entry[PATCH_INDEX_ENTRY_SIZE] = {(uint8_t)(address >> 8), (uint8_t)address};
+    uint16_t crc;
 
-    
-    /* MIDI Program Changes */
-    #ifdef DEBUG
-    printf(" - Reading MIDI PC\n");
-    #endif
+    stage_bytes(entry, patch_index_address[key], PATCH_INDEX_ENTRY_SIZE);
+
+    crc = crc16(&eeprom_image[SCHEMA_PATCH_INDEX.address], SCHEMA_PATCH_INDEX.size);
+    entry[0] = (uint8_t)(crc >> 8);
+    entry[1] = (uint8_t)crc;
+    stage_bytes(entry, SCHEMA_PATCH_INDEX_CRC.address, SCHEMA_PATCH_INDEX_CRC.size);
+}
 
-    location+= PATCH_MIDI_PC_OFFSET;
+/****************************************************************
+Function:   scan_heap
+Arguments:  none
+Return:     uint8_t (1 if a broken chain or stale tail was cleared)
+
+Follows the chain of record lengths from the start of the heap to
+find where the next record will be appended. A length which would
+run past the heap ends the chain, and everything after the last
+record is zeroed so the chain always ends on a zero length.
+****************************************************************/
+uint8_t StorageManager::scan_heap(void)
+{
+    uint16_t address = SCHEMA_PATCH_HEAP.address;
+    uint16_t heap_limit = SCHEMA_PATCH_HEAP.end();
+    uint8_t length;
+    uint8_t cleared = 0;
 
-    if(read_patch.num_midi_pc > 0)
+    while((address + RECORD_HEADER_SIZE) <= heap_limit)
     {
-        memset(read_buffer, 0, sizeof(read_buffer));
+        length = eeprom_image[address + RECORD_LENGTH_OFFSET];
+
+        if((length < patch_record_size(0, 0, 0)) || ((address + length) > heap_limit))
+        {
+            break;
+        }
+        address += length;
+    }
 
-        offset = location; // copy current byte offset for the purpose of optimising our loop without affecting the current data index - space for MIDI data is pre-allocated in the ROM, so we must always add its size to our offset, regardless of how many PC/CC messages have been saved
+    heap_end = address;
 
-        for(int i = 0; i < read_patch.num_midi_pc; i++)
+    for(; address < heap_limit; address++)
+    {
+        if(eeprom_image[address] != 0)
         {
-            eeprom.read_multiple_bytes(offset, MIDI_PC_SIZE, read_buffer);
-            read_patch.midi_program_changes[i].channel = read_buffer[0];
-            read_patch.midi_program_changes[i].data    = read_buffer[1];
-            offset+= MIDI_PC_SIZE;
+            eeprom_image[address] = 0;
+            cleared = 1;
         }
     }
 
-    /* MIDI Control Changes */
     #ifdef DEBUG
-    printf(" - Reading MIDI CC\n");
+    printf("StorageManager::scan_heap() - %d of %d bytes used\n", heap_end - SCHEMA_PATCH_HEAP.address, SCHEMA_PATCH_HEAP.size);
     #endif
-    location+= PATCH_MIDI_PC_DATA_SIZE; // no need to copy as nothing to read after program change messages
 
-    if(read_patch.num_midi_cc > 0)
+    return cleared;
+}
+
+/* Rebuilds the patch index from the keys of the valid live records on the heap */
+void StorageManager::rebuild_index(void)
+{
+    uint16_t address = SCHEMA_PATCH_HEAP.address;
+    uint8_t key;
+
+    for(uint8_t i = 0; i < PATCH_INDEX_ENTRIES; i++)
+    {
+        set_patch_index_entry(eeprom_image, i, PATCH_INDEX_EMPTY);
+    }
+
+    while(address < heap_end)
     {
-        memset(read_buffer, 0, sizeof(read_buffer));
+        key = eeprom_image[address + RECORD_KEY_OFFSET];
 
-        for(int i = 0; i < read_patch.num_midi_cc; i++)
+        if((key < PATCH_INDEX_ENTRIES) && patch_record_valid(&eeprom_image[address]))
         {
-            eeprom.read_multiple_bytes(location, MIDI_CC_SIZE, read_buffer);
-            read_patch.midi_control_changes[i].channel = read_buffer[0];
-            read_patch.midi_control_changes[i].controller = read_buffer[1];
-            read_patch.midi_control_changes[i].value = read_buffer[2];
-            location+= MIDI_CC_SIZE;
+            set_patch_index_entry(eeprom_image, key, address);
         }
+        address += eeprom_image[address + RECORD_LENGTH_OFFSET];
     }
-    return read_patch;
-}
 
-uint8_t StorageManager::write_active_bank(uint8_t bank)
-{
-    uint8_t result = eeprom.write_byte(bank, SYSTEM_INFO_OFFSET + LAST_BANK_OFFSET);
-    return result;
+    seal_patch_index(eeprom_image);
 }
 
-uint8_t StorageManager::write_active_patch(uint8_t patch)
+/* A record is live while the index entry of its key points at it, anything else on the heap is free space */
+bool StorageManager::record_live(uint16_t address)
 {
-    uint8_t result = eeprom.write_byte(patch, SYSTEM_INFO_OFFSET + LAST_PATCH_OFFSET);
-    return result;
+    uint8_t key = eeprom_image[address + RECORD_KEY_OFFSET];
+
+    return (key < PATCH_INDEX_ENTRIES) && (patch_index_entry(eeprom_image, key) == address);
 }
 
-uint8_t StorageManager::write_system_flags(uint8_t mode, uint8_t ctrl_a, uint8_t ctrl_b)
+/****************************************************************
+Function:   compact
+Arguments:  none
+Return:     uint16_t (bytes reclaimed)
+
+Runs a whole compaction, flushing after every step. Blocks for 
+every page written, so it is only for boot, before the main loop 
+starts; from then on compaction runs a step at a time from 
+service_idle().
+****************************************************************/
+uint16_t StorageManager::compact(void)
 {
-    uint8_t mask = 0;
-    uint8_t readback;
+    uint16_t start_end = heap_end;
 
-    mask |= mode;
-    mask |= ctrl_a << 1;
-    mask |= ctrl_b << 2;
+    start_compaction();
+
+    while((flush() == 0) && compact_step())
+    {
+    }
+    compact_state = COMPACT_IDLE;
+
+    #ifdef DEBUG
+    printf("StorageManager::compact() - %d bytes reclaimed\n", start_end - heap_end);
+    #endif
 
-    eeprom.write_byte(mask, SYSTEM_INFO_OFFSET);
+    return start_end - heap_end;
+}
 
-    readback = eeprom.read_byte(SYSTEM_INFO_OFFSET);
+/* Begins a compaction from idle, unless one is already under way */
+void StorageManager::start_compaction(void)
+{
+    compact_requested = false;
 
-    if(readback == mask)
+    if(compact_state == COMPACT_IDLE)
     {
-        return 0;
+        compact_state = COMPACT_MERGE;
     }
-    else
+}
+
+/****************************************************************
+Function:   compact_step
+Arguments:  none
+Return:     bool (false once the compaction has finished)
+
+Stages the next step of a compaction. Only called with nothing 
+dirty, so each step is committed before the next is staged, and 
+the heap is freed at the end without ever overwriting a live 
+record: runs of free records are merged, the free tail is cut off,
+then the last live record is moved into the first free record it 
+fits, and round again until it fits nowhere earlier. A move is 
+ordered so a reset at any point leaves the old copy, or a complete
+new one, as the valid record: split the free record, write the 
+copy, point the index at it, then mark the old copy dead. Until 
+the index entry is committed the old copy is the valid one; a torn
+index write fails its CRC and the index is rebuilt from the heap,
+where both copies are intact and identical. A copy left behind by
+a reset is cleared by validate_records(). Patches may be saved 
+between steps, so a move is dropped if its record is saved again.
+****************************************************************/
+bool StorageManager::compact_step(void)
+{
+    uint8_t length;
+    uint8_t hole_length;
+
+    while(true)
     {
-        return 1;
+        switch(compact_state)
+        {
+            case COMPACT_IDLE:
+                return false;
+
+            case COMPACT_MERGE:
+                compact_state = COMPACT_TRUNCATE;
+                if(merge_free_records())
+                {
+                    return true;
+                }
+                break;
+
+            case COMPACT_TRUNCATE:
+                compact_state = COMPACT_SPLIT;
+                if(truncate_heap())
+                {
+                    return true;
+                }
+                break;
+
+            case COMPACT_SPLIT:
+                compact_source = last_live_record();
+                compact_hole = PATCH_INDEX_EMPTY;
+
+                if(compact_source != PATCH_INDEX_EMPTY)
+                {
+                    compact_hole = find_hole(compact_source, eeprom_image[compact_source + RECORD_LENGTH_OFFSET]);
+                }
+
+                if(compact_hole == PATCH_INDEX_EMPTY)
+                {
+                    compact_state = COMPACT_IDLE;
+                    return false;
+                }
+
+                compact_state = COMPACT_COPY;
+                length = eeprom_image[compact_source + RECORD_LENGTH_OFFSET];
+                hole_length = eeprom_image[compact_hole + RECORD_LENGTH_OFFSET];
+
+                if(hole_length > length)
+                {
+                    stage_byte(RECORD_KEY_DEAD, compact_hole + length + RECORD_KEY_OFFSET);
+                    stage_byte(hole_length - length, compact_hole + length + RECORD_LENGTH_OFFSET);
+                    return true;
+                }
+                break;
+
+            case COMPACT_COPY:
+                /* Saved again since the move began, so it is no longer the last live record */
+                if(!record_live(compact_source))
+                {
+                    compact_state = COMPACT_MERGE;
+                    break;
+                }
+
+                stage_bytes(&eeprom_image[compact_source], compact_hole, eeprom_image[compact_source + RECORD_LENGTH_OFFSET]);
+                compact_state = COMPACT_INDEX;
+                return true;
+
+            case COMPACT_INDEX:
+                compact_state = COMPACT_RELEASE;
+
+                if(record_live(compact_source))
+                {
+                    set_index_entry(eeprom_image[compact_source + RECORD_KEY_OFFSET], compact_hole);
+                }
+                else
+                {
+                    stage_byte(RECORD_KEY_DEAD, compact_hole + RECORD_KEY_OFFSET);
+                }
+                return true;
+
+            case COMPACT_RELEASE:
+                compact_state = COMPACT_MERGE;
+
+                if(eeprom_image[compact_source + RECORD_KEY_OFFSET] != RECORD_KEY_DEAD)
+                {
+                    stage_byte(RECORD_KEY_DEAD, compact_source + RECORD_KEY_OFFSET);
+                    return true;
+                }
+                break;
+        }
     }
 }
 
-uint8_t StorageManager::write_patch_title(uint8_t bank, uint8_t patch, uint8_t* title)
+/* Merges each run of neighbouring free records into one, a single length byte each. True if anything was staged */
+bool StorageManager::merge_free_records(void)
 {
-    uint16_t byte_address; //TODO: Make this a lookup table instead for robustness?
-    uint8_t result;
-
-    byte_address = PATCH_DATA_OFFSET + (bank * BANK_DATA_SIZE) + (patch * PATCH_DATA_SIZE);
+    uint16_t address = SCHEMA_PATCH_HEAP.address;
+    uint16_t next;
+    uint16_t length;
+    bool merged = false;
 
-    #ifdef DEBUG
-    printf("Write Path Title Calculated Offset: %d\n", byte_address);
-    #endif
+    while(address < heap_end)
+    {
+        length = eeprom_image[address + RECORD_LENGTH_OFFSET];
 
-    memset(read_buffer, 0, sizeof(read_buffer));
+        if(!record_live(address))
+        {
+            for(next = address + length; (next < heap_end) && !record_live(next); next += eeprom_image[next + RECORD_LENGTH_OFFSET])
+            {
+                if((length + eeprom_image[next + RECORD_LENGTH_OFFSET]) > 0xFF)
+                {
+                    break;
+                }
+                length += eeprom_image[next + RECORD_LENGTH_OFFSET];
+            }
 
-    eeprom.write_multiple_bytes(title, byte_address, PATCH_TITLE_SIZE);
+            if(length != eeprom_image[address + RECORD_LENGTH_OFFSET])
+            {
+                stage_byte(RECORD_KEY_DEAD, address + RECORD_KEY_OFFSET);
+                stage_byte((uint8_t)length, address + RECORD_LENGTH_OFFSET);
+                merged = true;
+            }
+        }
+        address += length;
+    }
 
-    eeprom.read_multiple_bytes(byte_address, PATCH_TITLE_SIZE, read_buffer);
-    result = memcmp(read_buffer, write_buffer, PATCH_TITLE_SIZE);
-    return result;
+    return merged;
 }
 
-uint8_t StorageManager::write_patch_switch_data(void)
+/* Address of the last live record on the heap, PATCH_INDEX_EMPTY if there are none */
+uint16_t StorageManager::last_live_record(void)
 {
-    uint8_t result;
-    result = write_patch_output_mask();
-    //TODO:ext ctrl
+    uint16_t address = SCHEMA_PATCH_HEAP.address;
+    uint16_t last = PATCH_INDEX_EMPTY;
 
-    return result;
+    while(address < heap_end)
+    {
+        if(record_live(address))
+        {
+            last = address;
+        }
+        address += eeprom_image[address + RECORD_LENGTH_OFFSET];
+    }
+
+    return last;
 }
 
-uint8_t StorageManager::write_patch_output_mask(void)
+/****************************************************************
+Function:   truncate_heap
+Arguments:  none
+Return:     bool (true if anything was staged)
+
+Cuts the free records off the end of the heap by zeroing them. 
+Only zeros are written, so a reset part way through leaves every 
+length byte in the tail either as it was or zero, and the chain 
+still ends in the tail. The page holding the new end of the chain 
+is the lowest and so is committed last.
+****************************************************************/
+bool StorageManager::truncate_heap(void)
 {
-    uint8_t result;
-    uint8_t byte_offset = PATCH_DATA_OFFSET + ((pStateManager->get_active_bank()) * BANK_DATA_SIZE) + ((pStateManager->get_write_location()) * PATCH_DATA_SIZE) + PATCH_GENERAL_OFFSET + OUTPUT_BITMASK_OFFSET;
+    uint16_t last = last_live_record();
+    uint16_t tail = SCHEMA_PATCH_HEAP.address;
 
-    #ifdef DEBUG
-    printf("StorageManager::write_patch_output_mask()\n");
-    printf(" - Bank: %d, Patch: %d, Mask: %02x\n", pStateManager->get_active_bank(), pStateManager->get_write_location(), pStateManager->get_output_mask());
-    #endif
+    if(last != PATCH_INDEX_EMPTY)
+    {
+        tail = last + eeprom_image[last + RECORD_LENGTH_OFFSET];
+    }
 
-    result = eeprom.write_byte(pStateManager->get_output_mask(), byte_offset);
-    
-    #ifdef DEBUG
-    printf("Readback: %02x\n", eeprom.read_byte(byte_offset));
-    #endif
+    if(tail == heap_end)
+    {
+        return false;
+    }
 
-    return result;
+    memset(&eeprom_image[tail], 0, heap_end - tail);
+    heap_end = tail;
+    stage_changed_pages();
+
+    return true;
 }
 
-uint8_t StorageManager::validate_eeprom(void)
+/* First free record before limit that a record of length fills exactly, or leaves room for a free record after */
+uint16_t StorageManager::find_hole(uint16_t limit, uint8_t length)
 {
-    bool header_not_found;
-    bool footer_not_found;
-    int result = 0;
-    int address;
-    uint8_t offset;
-    char string_buffer[33];
-
-    memset(write_buffer, 0, CAT24C32_PAGE_SIZE);
-    memset(read_buffer, 0x00, CAT24C32_PAGE_SIZE);
+    uint16_t address = SCHEMA_PATCH_HEAP.address;
+    uint8_t hole_length;
 
-    /* Check first 4 bytes of EEPROM for the boot flag */
-    eeprom.read_multiple_bytes(BOOT_FLAG_OFFSET, BOOT_FLAG_SIZE, read_buffer);
+    while(address < limit)
+    {
+        hole_length = eeprom_image[address + RECORD_LENGTH_OFFSET];
 
-    #ifdef DEBUG
-    //sleep_ms(5000);
-    printf("Checking Boot Header:\n");
-    print_buff(read_buffer, BOOT_FLAG_SIZE);
-    fflush(stdout);
-    #endif
+        if(!record_live(address) &&
+           ((hole_length == length) || (hole_length >= (length + patch_record_size(0, 0, 0)))))
+        {
+            return address;
+        }
+        address += hole_length;
+    }
 
-    write_buffer[0] = (uint8_t)(BOOT_FLAG >> 24);
-    write_buffer[1] = (uint8_t)(BOOT_FLAG >> 16);
-    write_buffer[2] = (uint8_t)(BOOT_FLAG >> 8);
-    write_buffer[3] = (uint8_t)(BOOT_FLAG);
+    return PATCH_INDEX_EMPTY;
+}
 
-    header_not_found = memcmp(read_buffer, write_buffer, BOOT_FLAG_SIZE);
+/* Free space left at the end of the record heap */
+uint16_t StorageManager::get_heap_free(void)
+{
+    return SCHEMA_PATCH_HEAP.end() - heap_end;
+}
 
-    #ifdef DEBUG
-    printf("Header Result: %d\n", header_not_found);
-    #endif
+void StorageManager::seal_system_info_block(void)
+{
+    memcpy(read_buffer, &eeprom_image[SCHEMA_SYSTEM_INFO.address], SCHEMA_SYSTEM_INFO.size);
+    seal_system_info(read_buffer);
+    stage_bytes(read_buffer, SCHEMA_SYSTEM_INFO.address, SCHEMA_SYSTEM_INFO.size);
+}
 
-    memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-    eeprom.read_multiple_bytes(BOOT_FLAG_END_OFFSET, BOOT_FLAG_SIZE, read_buffer);
+/* Marks every page where the RAM image differs from the device as dirty */
+void StorageManager::stage_changed_pages(void)
+{
+    for(uint16_t page = 0; page < StorageEeprom::PAGE_COUNT; page++)
+    {
+        uint16_t page_address = page * StorageEeprom::PAGE_SIZE;
 
-    #ifdef DEBUG
-    printf("Checking Boot Footer:\n");
-    print_buff(read_buffer, BOOT_FLAG_SIZE);
-    fflush(stdout);
-    #endif
+        if(memcmp(&committed_image[page_address], &eeprom_image[page_address], StorageEeprom::PAGE_SIZE))
+        {
+            dirty_pages[page / 32] |= (1UL << (page % 32));
+        }
+    }
+    last_stage_time_us = time_us_64();
+}
 
-    footer_not_found = memcmp(read_buffer, write_buffer, BOOT_FLAG_SIZE);
-    
-    #ifdef DEBUG
-    printf("Footer Result %d\n", footer_not_found);
-    #endif
+/****************************************************************
+Function:   validate_records
+Arguments:  none
+Return:     uint8_t (number of records replaced with defaults)
+
+One pass over the RAM image checking the CRC of the system info 
+block, the patch index and every record it points to. The index is
+rebuilt from the heap if its CRC fails. Any patch without a valid
+record gets its default record from the compile time image, so a 
+torn write costs one patch rather than a re-format. Records the 
+index does not point at are marked dead.
+****************************************************************/
+uint8_t StorageManager::validate_records(void)
+{
+    uint8_t repaired = 0;
+    uint8_t cleared = 0;
+    uint16_t address;
+    const uint8_t *default_record;
 
-    //if(1)
-    if(header_not_found || footer_not_found)
+    if(!system_info_valid(&eeprom_image[SCHEMA_SYSTEM_INFO.address]))
     {
-        // TODO: maybe put something in here to inform that the pedal is doing some "setup" or whatever
-        
         #ifdef DEBUG
-        printf("First Boot!\n");
-        printf("Erasing...\n");
+        printf("StorageManager::validate_records() - System info failed CRC\n");
         #endif
+        memcpy(&eeprom_image[SCHEMA_SYSTEM_INFO.address], &default_image[SCHEMA_SYSTEM_INFO.address], SCHEMA_SYSTEM_INFO.size);
+        repaired++;
+    }
 
-        /* Erase all 4096 bytes of EEPROM */
-        eeprom.erase();
+    repaired += scan_heap();
 
+    if(!patch_index_valid(eeprom_image))
+    {
         #ifdef DEBUG
-        printf("All Erased, Readback:\n"); 
-        for(int i = 0; i < CAT24C32_PAGE_COUNT; i++)
+        printf("StorageManager::validate_records() - Patch index failed CRC, rebuilding\n");
+        #endif
+        rebuild_index();
+        repaired++;
+    }
+
+    for(uint8_t key = 0; key < PATCH_INDEX_ENTRIES; key++)
+    {
+        address = patch_index_entry(eeprom_image, key);
+
+        if((address != PATCH_INDEX_EMPTY) && (address >= SCHEMA_PATCH_HEAP.address) && (address < heap_end) &&
+           patch_record_valid(&eeprom_image[address]))
         {
-            address = i * CAT24C32_PAGE_SIZE;
-            eeprom.read_multiple_bytes(address, CAT24C32_PAGE_SIZE, read_buffer);
-            printf("Reading Page: %d\n", i);
-            print_buff(read_buffer, CAT24C32_PAGE_SIZE);
-            fflush(stdout);
+            /* The old record is marked dead before the index moves off it, a reset in between leaves it still indexed */
+            if(eeprom_image[address + RECORD_KEY_OFFSET] == RECORD_KEY_DEAD)
+            {
+                eeprom_image[address + RECORD_KEY_OFFSET] = key;
+                cleared++;
+            }
+
+            if(eeprom_image[address + RECORD_KEY_OFFSET] == key)
+            {
+                continue;
+            }
         }
-        
-        #endif
 
-        /* First boot, so prepare buffer with boot flag and write it to page 0 */
-        write_buffer[0] = (uint8_t)(BOOT_FLAG >> 24);
-        write_buffer[1] = (uint8_t)(BOOT_FLAG >> 16);
-        write_buffer[2] = (uint8_t)(BOOT_FLAG >> 8);
-        write_buffer[3] = (uint8_t)(BOOT_FLAG);
-        
         #ifdef DEBUG
-        printf("Buffer to be written:\n");
-        print_buff(write_buffer, BOOT_FLAG_SIZE);
+        printf("StorageManager::validate_records() - Bank %d Patch %d has no valid record\n", key / NUM_PATCHES, key % NUM_PATCHES);
         #endif
 
-        eeprom.write_multiple_bytes(write_buffer, BOOT_FLAG_OFFSET, BOOT_FLAG_SIZE);
+        set_patch_index_entry(eeprom_image, key, PATCH_INDEX_EMPTY);
+        seal_patch_index(eeprom_image);
 
-        memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-        eeprom.read_multiple_bytes(BOOT_FLAG_OFFSET, BOOT_FLAG_SIZE, read_buffer);
+        default_record = &default_image[patch_index_entry(default_image.data(), key)];
+        memcpy(patch_buffer, default_record, default_record[RECORD_LENGTH_OFFSET]);
+        store_record(key);
+        repaired++;
+    }
 
-        #ifdef DEBUG
-        printf("\n");
-        printf("Readback:\n");
-        print_buff(read_buffer, BOOT_FLAG_SIZE);
-        #endif
+    /* A compaction cut short can leave a second copy of a moved record, only the one the index points at stays live */
+    for(address = SCHEMA_PATCH_HEAP.address; address < heap_end; address += eeprom_image[address + RECORD_LENGTH_OFFSET])
+    {
+        if((eeprom_image[address + RECORD_KEY_OFFSET] != RECORD_KEY_DEAD) && !record_live(address))
+        {
+            eeprom_image[address + RECORD_KEY_OFFSET] = RECORD_KEY_DEAD;
+            cleared++;
+        }
+    }
+
+    if(repaired || cleared)
+    {
+        stage_changed_pages();
+    }
+    return repaired;
+}
 
-        result = memcmp(write_buffer, read_buffer, BOOT_FLAG_SIZE);
+/****************************************************************
+Function:   migrate
+Arguments:  (uint8_t) from_version
+Return:     uint8_t (0 on success)
+
+Converts the fixed size patch records of an older layout, as 
+described in storage_layouts[], into the patch index and record 
+heap and writes them to the device. Records which fail their CRC 
+are skipped and restored by validate_records().
+
+The old records are only overwritten once their replacements are 
+committed. The converted records are written above the old ones,
+top page first, then the space below them becomes free records and
+the index is built, and page 0 holding the layout version is 
+written last. A reset before the first converted record is written
+leaves the old records intact for the next boot to convert again;
+after it, the next boot finds that record valid and carries on 
+from the converted heap. If the converted records do not fit above
+the old ones they are built over them in one pass, which a reset 
+part way through can still cost records.
+****************************************************************/
+uint8_t StorageManager::migrate(uint8_t from_version)
+{
+    const STORAGE_LAYOUT_X *old_layout = nullptr;
+    const uint8_t *first_record;
+    uint16_t start;
+    uint8_t result = 0;
 
-        if(result)
-        {   
-            #ifdef DEBUG
-            printf("WRITE FAILED\n");
-            return result;
-            #endif
+    for(const STORAGE_LAYOUT_X &layout : storage_layouts)
+    {
+        if(layout.version == from_version)
+        {
+            old_layout = &layout;
         }
+    }
+
+    if(old_layout == nullptr)
+    {
+        return 1;
+    }
+
+    #ifdef DEBUG
+    printf("StorageManager::migrate() - Layout %d -> %d\n", from_version, STORAGE_LAYOUT_VERSION);
+    #endif
+
+    start = old_layout->patch_data_offset + (TOTAL_PATCHES * old_layout->patch_data_size);
+    first_record = &committed_image[start];
+
+    if((first_record[RECORD_KEY_OFFSET] < PATCH_INDEX_ENTRIES) && patch_record_valid(first_record))
+    {
         #ifdef DEBUG
+        printf("StorageManager::migrate() - Converted records found, resuming\n");
+        #endif
+    }
+    else
+    {
+        memset(&eeprom_image[start], 0, SCHEMA_JOURNAL.address - start);
+
+        if(convert_records(old_layout, start))
+        {
+            stage_changed_pages();
+            result = flush();
+        }
         else
         {
-            printf("Boot flag written and readback successfully!\n");
+            start = SCHEMA_PATCH_HEAP.address;
+            memset(&eeprom_image[SCHEMA_PATCH_HEAP.address], 0, SCHEMA_PATCH_HEAP.size);
+            convert_records(old_layout, start);
         }
-        #endif
+    }
 
-        /* Write default system data */
-        #ifdef DEBUG
-        printf("Writing System Info Defaults...\n");
-        #endif
+    if(result)
+    {
+        return result;
+    }
 
-        memset(write_buffer, 0, SYSTEM_INFO_SIZE);
+    /* Converted records are on the device, the old ones below them can now go */
+    memset(&eeprom_image[SCHEMA_SYSTEM_INFO.end()], 0, start - SCHEMA_SYSTEM_INFO.end());
+    fill_free(SCHEMA_PATCH_HEAP.address, start);
+    scan_heap();
+    rebuild_index();
+    stage_changed_pages();
 
-        write_buffer[0] = 0b00000000; // setting defaults for mode/ext ctrl A/B type
-        write_buffer[1] = 0;          // default bank: 1
-        write_buffer[2] = 0;          // default patch: 1
+    result = flush_pages(StorageEeprom::PAGE_COUNT - 1, 1);
 
-        #ifdef DEBUG
-        printf("Sys Info Buffer:\n");
-        print_buff(write_buffer, SYSTEM_INFO_SIZE); // remaining bytes reserved for IP address/other data in future
-        #endif
+    if(result)
+    {
+        return result;
+    }
 
-        /* Readback the data to check */
-        eeprom.write_multiple_bytes(write_buffer, SYSTEM_INFO_OFFSET, SYSTEM_INFO_SIZE);
+    seal_system_info(&eeprom_image[SCHEMA_SYSTEM_INFO.address]);
+    stage_changed_pages();
 
-        memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-        eeprom.read_multiple_bytes(SYSTEM_INFO_OFFSET, SYSTEM_INFO_SIZE, read_buffer);
+    return flush_pages(0, 0);
+}
 
-        #ifdef DEBUG
-        printf("Sys Info Readback:\n");
-        print_buff(read_buffer, SYSTEM_INFO_SIZE);
-        #endif
+/* Builds the old layout's records, read from the device, as a chain in the RAM image from address. False if they do not fit the heap */
+bool StorageManager::convert_records(const STORAGE_LAYOUT_X *old_layout, uint16_t address)
+{
+    const uint8_t *source;
+    uint8_t *record = patch_buffer;
+    uint8_t title_length;
+    uint8_t num_midi_pc;
+    uint8_t num_midi_cc;
 
-        result = memcmp(read_buffer, write_buffer, SYSTEM_INFO_SIZE);
+    for(uint8_t key = 0; key < TOTAL_PATCHES; key++)
+    {
+        source = &committed_image[old_layout->patch_data_offset + (key * old_layout->patch_data_size)];
 
-        if(result)
+        if(old_layout->has_crc && !fixed_patch_record_valid(source))
         {
-            //TODO: Different return values to indicate different failure?
-            #ifdef DEBUG
-            printf("ERROR WRITING SYS INFO\n");
-            #endif
-            return result;
-        }    
+            continue;
+        }
 
+        title_length = strnlen((const char *)&source[PATCH_TITLE_OFFSET], PATCH_TITLE_SIZE);
+        num_midi_pc  = source[PATCH_GENERAL_OFFSET + PATCH_NUM_MIDI_PC_OFFSET];
+        num_midi_cc  = source[PATCH_GENERAL_OFFSET + PATCH_NUM_MIDI_CC_OFFSET];
 
-        for(int bank = 0; bank < NUM_BANKS; bank++)
+        if(num_midi_pc > PATCH_MAX_MIDI_PC)
         {
-            for(int patch = 0; patch < NUM_PATCHES; patch++)
-            {
-                memset(string_buffer, 0, sizeof(string_buffer));
-                memset(write_buffer, 0, sizeof(write_buffer));
-
-                sprintf(string_buffer, PATCH_DEFAULT_TITLE, patch);
-                #ifdef DEBUG
-                printf("Formatted String: [%s]\n", string_buffer);
-                fflush(stdout);
-                #endif
-
-                memcpy(write_buffer, string_buffer, strlen(string_buffer));
-                write_patch_title(bank, patch, write_buffer);
-
-                memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-
-                #ifdef DEBUG
-                eeprom.read_multiple_bytes(PATCH_DATA_OFFSET + (bank * BANK_DATA_SIZE) + (patch * PATCH_DATA_SIZE), PATCH_TITLE_SIZE, read_buffer);
-                memset(string_buffer, 0, sizeof(string_buffer));
-                memcpy(string_buffer, read_buffer, sizeof(string_buffer));
-                printf("Bank: %d Patch: %d [%s]\n", bank, patch, string_buffer);
-                fflush(stdout);
-                #endif
-            }
+            num_midi_pc = PATCH_MAX_MIDI_PC;
         }
-        
-        // ----------------------------------------------------------------
-
-        memset(write_buffer, 0xFF, CAT24C32_PAGE_SIZE);
-        eeprom.write_multiple_bytes(write_buffer, 168, CAT24C32_PAGE_SIZE);
 
-        write_buffer[0] = (uint8_t)(BOOT_FLAG >> 24);
-        write_buffer[1] = (uint8_t)(BOOT_FLAG >> 16);
-        write_buffer[2] = (uint8_t)(BOOT_FLAG >> 8);
-        write_buffer[3] = (uint8_t)(BOOT_FLAG);
+        if(num_midi_cc > PATCH_MAX_MIDI_CC)
+        {
+            num_midi_cc = PATCH_MAX_MIDI_CC;
+        }
 
-        eeprom.write_multiple_bytes(write_buffer, BOOT_FLAG_END_OFFSET, BOOT_FLAG_SIZE);
+        record[RECORD_KEY_OFFSET]          = key;
+        record[RECORD_CTRL_FLAGS_OFFSET]   = source[PATCH_GENERAL_OFFSET + PATCH_CTRL_FLAGS_OFFSET];
+        record[RECORD_OUTPUT_MASK_OFFSET]  = source[PATCH_GENERAL_OFFSET + OUTPUT_BITMASK_OFFSET];
+        record[RECORD_TITLE_LENGTH_OFFSET] = title_length;
+        record[RECORD_NUM_MIDI_OFFSET]     = num_midi_pc | (num_midi_cc << PACKED_NUM_MIDI_CC_SHIFT);
 
-        #ifdef DEBUG
-        printf("All Readback:\n"); 
+        memcpy(&record[RECORD_TITLE_OFFSET], &source[PATCH_TITLE_OFFSET], title_length);
+        memcpy((uint8_t *)record_midi_pc(record), &source[PATCH_MIDI_PC_OFFSET], num_midi_pc * MIDI_PC_SIZE);
+        memcpy((uint8_t *)record_midi_cc(record), &source[PATCH_MIDI_CC_DATA_OFFSET], num_midi_cc * MIDI_CC_SIZE);
 
-        for(int i = 0; i < CAT24C32_PAGE_COUNT; i++)
+        if((address + seal_patch_record(record)) > SCHEMA_PATCH_HEAP.end())
         {
-            address = i * CAT24C32_PAGE_SIZE;
-            memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-            eeprom.read_multiple_bytes(address, CAT24C32_PAGE_SIZE, read_buffer);
-            printf("Reading Page: %d\n", i);
-            print_buff(read_buffer, CAT24C32_PAGE_SIZE);
-            fflush(stdout);
+            return false;
         }
-        #endif
-    }
-    #ifdef DEBUG
-    else
-    {
-        printf("Boot Flags Detected, Pass Validation\n");
+
+        memcpy(&eeprom_image[address], record, record[RECORD_LENGTH_OFFSET]);
+        address += record[RECORD_LENGTH_OFFSET];
     }
-    #endif
-    return result;
+
+    return true;
 }
 
-void StorageManager::test(void)
+/* Covers [address, end) with free records so the heap chain steps over it, end - address is at least one minimum record */
+void StorageManager::fill_free(uint16_t address, uint16_t end)
 {
-    uint16_t address;
-    uint8_t test_buffer[64];
-
-    eeprom.erase();
+    uint16_t length;
 
-    for(int i = 0; i < 8; i++)
+    while(address < end)
     {
-        address = i * CAT24C32_PAGE_SIZE;
-        memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-        eeprom.read_multiple_bytes(address, CAT24C32_PAGE_SIZE, read_buffer);
-        printf("Reading Page: %d\n", i);
-        print_buff(read_buffer, CAT24C32_PAGE_SIZE);
-        fflush(stdout);
-    }   
-
-    memset(test_buffer, 0xAA, 32);
-    memset(&test_buffer[32], 0xBB, 32);
+        length = end - address;
 
-    eeprom.write_multiple_bytes(test_buffer, 0, 64);
-
-    printf("All Readback:\n"); 
+        if(length > 0xFF)
+        {
+            length = ((length - 0xFF) < patch_record_size(0, 0, 0)) ? (length - patch_record_size(0, 0, 0)) : 0xFF;
+        }
 
-    for(int i = 0; i < 8; i++)
-    {
-        address = i * CAT24C32_PAGE_SIZE;
-        memset(read_buffer, 0, CAT24C32_PAGE_SIZE);
-        eeprom.read_multiple_bytes(address, CAT24C32_PAGE_SIZE, read_buffer);
-        printf("Reading Page: %d\n", i);
-        print_buff(read_buffer, CAT24C32_PAGE_SIZE);
-        fflush(stdout);
-    }    
+        eeprom_image[address + RECORD_KEY_OFFSET]    = RECORD_KEY_DEAD;
+        eeprom_image[address + RECORD_LENGTH_OFFSET] = (uint8_t)length;
+        address += length;
+    }
 }
-
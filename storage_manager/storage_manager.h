@@ -5,35 +5,190 @@
 
 /* Pico Includes */
 #include "pico/stdlib.h"
+#include "pico/util/queue.h"
 
 /* Project Includes */
 #include "gpio_defs.h"
 #include "CAT24C32.h"
+#include "storage_image.h"
+
+/* Time without new writes before dirty pages are flushed from the idle loop */
+#define STORAGE_IDLE_FLUSH_MS 500
+
+/* Attempts at a blocking page write before the page is reported as failed */
+#define STORAGE_WRITE_ATTEMPTS 2
+
+/* Background storage jobs */
+#define STORAGE_JOB_QUEUE_LENGTH 4
+#define STORAGE_JOB_SWITCH_DATA  0x01
+
+/* Status of a record store when the heap has no room for it until it is compacted */
+#define STORAGE_HEAP_FULL        2
+
+/* States of the non-blocking page flush */
+typedef enum flush_state
+{
+    FLUSH_IDLE,
+    FLUSH_WRITING,
+    FLUSH_WRITE_CYCLE
+} FLUSH_STATE;
+
+/* Steps of a heap compaction, each committed before the next is staged */
+typedef enum compact_state
+{
+    COMPACT_IDLE,
+    COMPACT_MERGE,
+    COMPACT_TRUNCATE,
+    COMPACT_SPLIT,
+    COMPACT_COPY,
+    COMPACT_INDEX,
+    COMPACT_RELEASE
+} COMPACT_STATE;
+
+typedef struct storage_job_x
+{
+    uint8_t job_code;
+    uint8_t bank;
+    uint8_t patch;
+    uint8_t output_mask;
+} STORAGE_JOB_X;
 
 class StateManager;
-extern const char* PATCH_DEFAULT_TITLE;
+class FlashLibrary;
 class StorageManager
 {
     private:
-        CAT24C32 eeprom;
+        StorageEeprom eeprom;
         StateManager *pStateManager;
+        FlashLibrary *pFlashLibrary;
+
+        /* Pending jobs, and the queue their results are reported on */
+        queue_t job_queue;
+        queue_t *result_queue;
+        STORAGE_JOB_X active_job;
+        bool job_active;
+        bool job_deferred;
+        uint8_t job_result;
+
+        /* A result which found the queue full, posted again before the next job starts */
+        QUEUE_ITEM_X result_item;
+        bool result_pending;
+
+        uint8_t write_buffer[StorageEeprom::PAGE_SIZE];
+        uint8_t read_buffer[StorageEeprom::PAGE_SIZE];
+
+        /* Staging buffer for building or editing a whole variable length patch record */
+        uint8_t patch_buffer[PATCH_RECORD_MAX_SIZE];
 
-        uint8_t write_buffer[CAT24C32_PAGE_SIZE];
-        uint8_t read_buffer[CAT24C32_PAGE_SIZE];
+        /* RAM shadow of the entire EEPROM, loaded once at boot */
+        uint8_t eeprom_image[StorageEeprom::TOTAL_BYTES];
+        bool image_loaded;
+
+        /* Write-back cache: contents known to be on the device, and one dirty bit per page */
+        uint8_t committed_image[StorageEeprom::TOTAL_BYTES];
+        uint32_t dirty_pages[StorageEeprom::PAGE_COUNT / 32];
+        uint64_t last_stage_time_us;
+
+        /* Set while a restore is being staged, so neither the idle flush nor a job writes part of it */
+        bool flush_held;
+
+        /* Address the next record is appended at, the first zero length in the record heap */
+        uint16_t heap_end;
+
+        /* Compaction run a step at a time from idle: the record being moved and the free record it goes to */
+        COMPACT_STATE compact_state;
+        uint16_t compact_source;
+        uint16_t compact_hole;
+        bool compact_requested;
+
+        /* Page currently being written by DMA, and a snapshot of the data sent */
+        FLUSH_STATE flush_state;
+        uint16_t flush_page_index;
+        uint16_t flush_address;
+        uint8_t flush_span;
+        uint8_t flush_buffer[StorageEeprom::PAGE_SIZE];
+
+        /* System state journal: slot of the newest valid record (-1 if empty) and its sequence number */
+        int16_t journal_head;
+        uint16_t journal_sequence;
+
+        void scan_journal(void);
+        uint8_t journal_check(uint8_t *record);
+        void append_journal(uint8_t flags, uint8_t bank, uint8_t patch);
+        void read_journal_state(uint8_t *flags, uint8_t *bank, uint8_t *patch);
+
+        void decode_patch(const uint8_t *source, PATCH_DATA_X *destination);
+        uint8_t pack_patch(const uint8_t *source, PATCH_PACKED_X *destination);
+
+        void read_bytes(uint16_t byte_address, uint16_t num_bytes, uint8_t *destination);
+        int write_bytes(uint8_t *source, uint16_t byte_address, uint16_t num_bytes);
+        void stage_bytes(uint8_t *source, uint16_t byte_address, uint16_t num_bytes);
+        void stage_byte(uint8_t byte, uint16_t byte_address);
+        void stage_changed_pages(void);
+
+        const uint8_t * preset_record(uint8_t bank, uint8_t patch);
+        uint8_t load_record_buffer(uint8_t bank, uint8_t patch);
+        uint8_t store_preset(uint8_t bank, uint8_t patch);
+        uint8_t store_record(uint8_t key);
+        void set_index_entry(uint8_t key, uint16_t address);
+        uint8_t scan_heap(void);
+        void rebuild_index(void);
+        bool record_live(uint16_t address);
+        uint16_t last_live_record(void);
+        uint16_t compact(void);
+        bool compact_step(void);
+        void start_compaction(void);
+        bool merge_free_records(void);
+        bool truncate_heap(void);
+        uint16_t find_hole(uint16_t limit, uint8_t length);
+        void seal_system_info_block(void);
+        uint8_t validate_records(void);
+        uint8_t migrate(uint8_t from_version);
+        bool convert_records(const STORAGE_LAYOUT_X *old_layout, uint16_t address);
+        void fill_free(uint16_t address, uint16_t end);
+
+        uint8_t changed_span(uint16_t page, uint16_t *first);
+        uint8_t flush_page(uint16_t page);
+        uint8_t flush_pages(uint16_t first, uint16_t last);
+        uint8_t finish_flush_page(void);
+        bool flush_step(uint8_t *result);
+        void complete_flush(void);
+        void service_idle(void);
+        bool next_job(void);
 
     public:
         StorageManager(i2c_inst_t *i2c_instance, uint8_t i2c_address);
-        void initialise(StateManager *pStateManager);
+        void initialise(StateManager *pStateManager, FlashLibrary *pFlashLibrary, queue_t *result_queue);
         void factory_reset(void);
+        void load_image(void);
+
+        uint8_t flush(void);
+        void flush_idle(void);
+        void hold_flush(bool hold);
+        bool is_dirty(void);
+        void release_bus(void);
+
+        bool queue_patch_switch_data(uint8_t bank, uint8_t patch, uint8_t output_mask);
+        void service(void);
 
         uint8_t validate_eeprom(void);
+        uint8_t format(void);
+        const uint8_t * get_image(void);
+        uint8_t restore_image(const uint8_t *image);
+        uint8_t restore_record(const uint8_t *record, uint16_t length);
+        void read_system_block(uint8_t *destination);
+        uint8_t restore_system_block(const uint8_t *source);
+        uint16_t get_heap_free(void);
 
         void read_system_data(void);
         void write_system_data(void); //TODO: maybe don't need this...
 
         uint8_t write_patch_switch_data(void);
-        BANK_DATA_X read_bank(uint8_t bank);
-        PATCH_DATA_X read_patch(uint8_t bank, uint8_t patch);
+        void read_bank(uint8_t bank, BANK_DATA_X *destination);
+        void read_patch(uint8_t bank, uint8_t patch, PATCH_DATA_X *destination);
+        const uint8_t * patch_record(uint8_t bank, uint8_t patch);
+        uint8_t read_patch_packed(uint8_t bank, uint8_t patch, PATCH_PACKED_X *destination);
+        void read_patch_title(uint8_t bank, uint8_t patch, char *title);
 
         uint8_t write_system_flags(uint8_t mode, uint8_t ctrl_a, uint8_t ctrl_b);
         uint8_t write_active_bank(uint8_t bank);
@@ -41,10 +196,9 @@ class StorageManager
 
         uint8_t write_patch_title(uint8_t bank, uint8_t patch, uint8_t* title);
         uint8_t write_patch_output_mask();
+        uint8_t write_patch_output_mask(uint8_t bank, uint8_t patch, uint8_t output_mask);
         uint8_t write_patch_midi_pc(uint8_t bank, uint8_t patch, uint8_t midi_pc_location, MIDI_PC_DATA_X x_midi_pc_data);
         uint8_t write_patch_midi_cc(uint8_t bank, uint8_t patch, uint8_t midi_cc_location, MIDI_CC_DATA_X x_midi_cc_data);
-
-        void test(void);
 };
 
 #endif
\ No newline at end of file
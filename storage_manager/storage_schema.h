@@ -0,0 +1,130 @@
+#ifndef STORAGE_SCHEMA_H
+#define STORAGE_SCHEMA_H
+
+/* C/C++ Includes */
+#include <array>
+
+/* Project Includes */
+#include "gpio_defs.h"
+#include "CAT24C32.h"
+
+/* EEPROM part the storage layout is placed on, any part aliased in CAT24C32.h can be selected here */
+using StorageEeprom = CAT24C32;
+
+/* Absolute location and size of a region or field in the EEPROM, or an offset and size within a record */
+typedef struct storage_field_x
+{
+    uint16_t address;
+    uint16_t size;
+
+    constexpr uint16_t end(void) const { return address + size; }
+} STORAGE_FIELD_X;
+
+/* Regions, in address order */
+constexpr STORAGE_FIELD_X SCHEMA_BOOT_HEADER     = {BOOT_FLAG_OFFSET, BOOT_FLAG_SIZE};
+constexpr STORAGE_FIELD_X SCHEMA_SYSTEM_INFO     = {SYSTEM_INFO_OFFSET, SYSTEM_INFO_SIZE};
+constexpr STORAGE_FIELD_X SCHEMA_PATCH_INDEX     = {PATCH_INDEX_OFFSET, PATCH_INDEX_ENTRIES * PATCH_INDEX_ENTRY_SIZE};
+constexpr STORAGE_FIELD_X SCHEMA_PATCH_INDEX_CRC = {PATCH_INDEX_CRC_OFFSET, 2};
+constexpr STORAGE_FIELD_X SCHEMA_PATCH_HEAP      = {PATCH_HEAP_OFFSET, PATCH_HEAP_SIZE};
+constexpr STORAGE_FIELD_X SCHEMA_JOURNAL         = {JOURNAL_OFFSET, JOURNAL_SIZE};
+constexpr STORAGE_FIELD_X SCHEMA_BOOT_FOOTER     = {BOOT_FLAG_END_OFFSET, BOOT_FLAG_SIZE};
+
+constexpr STORAGE_FIELD_X storage_regions[] =
+{
+    SCHEMA_BOOT_HEADER, SCHEMA_SYSTEM_INFO, SCHEMA_PATCH_INDEX, SCHEMA_PATCH_INDEX_CRC,
+    SCHEMA_PATCH_HEAP, SCHEMA_JOURNAL, SCHEMA_BOOT_FOOTER
+};
+
+/* System info fields, in address order */
+constexpr STORAGE_FIELD_X SCHEMA_SYSTEM_FLAGS    = {SYSTEM_INFO_OFFSET + FLAGS_OFFSET, 1};
+constexpr STORAGE_FIELD_X SCHEMA_LAST_BANK       = {SYSTEM_INFO_OFFSET + LAST_BANK_OFFSET, 1};
+constexpr STORAGE_FIELD_X SCHEMA_LAST_PATCH      = {SYSTEM_INFO_OFFSET + LAST_PATCH_OFFSET, 1};
+constexpr STORAGE_FIELD_X SCHEMA_LAYOUT_VERSION  = {SYSTEM_INFO_OFFSET + LAYOUT_VERSION_OFFSET, 1};
+constexpr STORAGE_FIELD_X SCHEMA_SYSTEM_CRC      = {SYSTEM_INFO_OFFSET + SYSTEM_CRC_OFFSET, SYSTEM_CRC_SIZE};
+constexpr STORAGE_FIELD_X SCHEMA_IP_ADDRESS      = {SYSTEM_INFO_OFFSET + IP_ADDRESS_OFFSET, IP_ADDRESS_SIZE};
+
+constexpr STORAGE_FIELD_X system_info_fields[] =
+{
+    SCHEMA_SYSTEM_FLAGS, SCHEMA_LAST_BANK, SCHEMA_LAST_PATCH, SCHEMA_LAYOUT_VERSION, SCHEMA_SYSTEM_CRC, SCHEMA_IP_ADDRESS
+};
+
+/* Variable length record header fields, offsets within the record, in order */
+constexpr STORAGE_FIELD_X record_header_fields[] =
+{
+    {RECORD_KEY_OFFSET, 1}, {RECORD_LENGTH_OFFSET, 1}, {RECORD_CTRL_FLAGS_OFFSET, 1},
+    {RECORD_OUTPUT_MASK_OFFSET, 1}, {RECORD_TITLE_LENGTH_OFFSET, 1}, {RECORD_NUM_MIDI_OFFSET, 1}
+};
+
+/* Journal record fields, offsets within the record, in order */
+constexpr STORAGE_FIELD_X journal_record_fields[] =
+{
+    {JOURNAL_SEQUENCE_OFFSET, 2}, {JOURNAL_FLAGS_OFFSET, 1}, {JOURNAL_BANK_OFFSET, 1},
+    {JOURNAL_PATCH_OFFSET, 1}, {JOURNAL_CHECK_OFFSET, 1}
+};
+
+/* True if every field lies within [first, limit) and each ends at or before the next begins */
+template <size_t count>
+constexpr bool fields_packed(const STORAGE_FIELD_X (&fields)[count], uint16_t first, uint16_t limit)
+{
+    uint16_t position = first;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if((fields[i].size == 0) || (fields[i].address < position))
+        {
+            return false;
+        }
+        position = fields[i].end();
+    }
+    return position <= limit;
+}
+
+static_assert(fields_packed(storage_regions, 0, StorageEeprom::TOTAL_BYTES), "Storage regions overlap or run past the end of the EEPROM");
+static_assert(fields_packed(system_info_fields, SCHEMA_SYSTEM_INFO.address, SCHEMA_SYSTEM_INFO.end()), "System info fields overlap or overflow the block");
+static_assert(SCHEMA_SYSTEM_CRC.end() == SCHEMA_IP_ADDRESS.address, "System info CRC covers the bytes before it, the IP address follows");
+static_assert(fields_packed(record_header_fields, 0, RECORD_HEADER_SIZE), "Record header fields overlap or overflow the header");
+static_assert(RECORD_TITLE_OFFSET == RECORD_HEADER_SIZE, "Record title follows the header");
+static_assert(fields_packed(journal_record_fields, 0, JOURNAL_RECORD_SIZE), "Journal record fields overlap or overflow the record");
+static_assert(JOURNAL_CHECK_OFFSET == (JOURNAL_RECORD_SIZE - 1), "Journal check byte covers the bytes before it");
+static_assert((JOURNAL_SIZE % JOURNAL_RECORD_SIZE) == 0, "Journal holds a whole number of records");
+
+/* Fit to the selected part */
+static_assert(StorageEeprom::TOTAL_BYTES <= PATCH_INDEX_EMPTY, "Patch index entries cannot address the whole EEPROM");
+static_assert((JOURNAL_OFFSET % StorageEeprom::PAGE_SIZE) == 0, "Journal must start on a page boundary");
+static_assert((PATCH_INDEX_OFFSET % StorageEeprom::PAGE_SIZE) == 0, "Patch index must start on the page after the layout version");
+static_assert(SCHEMA_LAYOUT_VERSION.address < StorageEeprom::PAGE_SIZE, "Layout version must be on page 0, committed last by a migration");
+static_assert((StorageEeprom::PAGE_SIZE % JOURNAL_RECORD_SIZE) == 0, "Journal records must not straddle pages");
+static_assert((StorageEeprom::PAGE_COUNT % 32) == 0, "Dirty page bitmap is kept in whole 32 bit words");
+
+/* Record encoding limits */
+static_assert(PATCH_RECORD_MAX_SIZE <= 0xFF, "Record length is a single byte");
+static_assert(PATCH_INDEX_ENTRIES <= RECORD_KEY_DEAD, "Record keys must not collide with the dead marker");
+static_assert((PATCH_MAX_MIDI_PC <= PACKED_NUM_MIDI_PC_MASK) && (PATCH_MAX_MIDI_CC <= (0xFF >> PACKED_NUM_MIDI_CC_SHIFT)), "MIDI counts must fit their nibbles");
+static_assert(PATCH_INDEX_ENTRIES == TOTAL_PATCHES, "Every EEPROM patch has an index entry and a default record");
+
+/* Index key of a patch, keys run bank by bank */
+constexpr uint8_t patch_key(uint8_t bank, uint8_t patch)
+{
+    return (bank * NUM_PATCHES) + patch;
+}
+
+/* Absolute address of every patch index entry and journal slot, resolved at compile time */
+template <size_t count>
+constexpr std::array<uint16_t, count> make_address_table(uint16_t first, uint16_t stride)
+{
+    std::array<uint16_t, count> table{};
+
+    for(size_t i = 0; i < count; i++)
+    {
+        table[i] = first + (i * stride);
+    }
+    return table;
+}
+
+constexpr std::array<uint16_t, PATCH_INDEX_ENTRIES> patch_index_address = make_address_table<PATCH_INDEX_ENTRIES>(SCHEMA_PATCH_INDEX.address, PATCH_INDEX_ENTRY_SIZE);
+constexpr std::array<uint16_t, JOURNAL_RECORD_COUNT> journal_slot_address = make_address_table<JOURNAL_RECORD_COUNT>(SCHEMA_JOURNAL.address, JOURNAL_RECORD_SIZE);
+
+static_assert(patch_index_address[PATCH_INDEX_ENTRIES - 1] + PATCH_INDEX_ENTRY_SIZE == SCHEMA_PATCH_INDEX.end(), "Patch index table does not cover the index");
+static_assert(journal_slot_address[JOURNAL_RECORD_COUNT - 1] + JOURNAL_RECORD_SIZE == SCHEMA_JOURNAL.end(), "Journal slot table does not cover the journal");
+
+#endif
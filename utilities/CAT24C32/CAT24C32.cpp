@@ -6,92 +6,473 @@
 #include <string>
 
 
-CAT24C32::CAT24C32(i2c_inst_t *i2c_instance, uint8_t i2c_address)
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+I2CEeprom<page_size, total_bytes, address_bytes>::I2CEeprom(i2c_inst_t *i2c_instance, uint8_t i2c_address)
 {
     this->i2c_instance = i2c_instance;       
     this->i2c_address  = i2c_address;
+    this->write_cycle_address = i2c_address;
 }
 
 
-void CAT24C32::write_multiple_bytes(uint8_t *source, uint16_t byte_address, uint16_t num_bytes)
+/* Puts the word address into buffer and returns the number of address bytes. One byte
+parts take the address bits above the first byte as block select bits in the device address */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+uint8_t I2CEeprom<page_size, total_bytes, address_bytes>::load_address(uint8_t *buffer, uint16_t byte_address)
 {
-    for(int i = 0; i < num_bytes; i++)
+    if constexpr(address_bytes == 2)
     {
-        /* Prepare address bytes */
-        command_buffer[0] = (uint8_t) (byte_address >> 8);
-        command_buffer[1] = (uint8_t) byte_address;
-
-        /* Copy the data to be written into the buffer at the correct position */
-        memcpy(&command_buffer[2], &source[i], 1);
+        buffer[0] = (uint8_t) (byte_address >> 8);
+        buffer[1] = (uint8_t) byte_address;
+    }
+    else
+    {
+        buffer[0] = (uint8_t) byte_address;
+    }
+    return address_bytes;
+}
 
-        i2c_write_blocking(i2c_instance, i2c_address, command_buffer, 3, false);
-        sleep_ms(I2C_TIMING);
-        byte_address++;
+/* Device address for a transfer starting at byte_address */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+uint8_t I2CEeprom<page_size, total_bytes, address_bytes>::device_address(uint16_t byte_address)
+{
+    if constexpr(address_bytes == 2)
+    {
+        return i2c_address;
+    }
+    else
+    {
+        return i2c_address | (uint8_t)(byte_address >> 8);
     }
 }
 
-/* Uncapped read function, must pass a pointer to an array 
-big enough to hold the requested number of bytes */
-void CAT24C32::read_multiple_bytes(uint16_t byte_address, uint16_t num_bytes, uint8_t *destination)
+/* Page-aware write: the buffer is split at page boundaries so each page is sent as a
+single transaction (address bytes + up to one page of data), with one write cycle wait per page */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+int I2CEeprom<page_size, total_bytes, address_bytes>::write_multiple_bytes(uint8_t *source, uint16_t byte_address, uint32_t num_bytes)
 {
-    command_buffer[0] = (uint8_t) (byte_address >> 8);
-    command_buffer[1] = (uint8_t) byte_address;
+    uint16_t chunk;
+    int result = 0;
 
-    i2c_write_blocking(i2c_instance, i2c_address, command_buffer, 2, false);
+    if((byte_address + num_bytes) > total_bytes)
+    {
+        return 1;
+    }
 
-    sleep_ms(I2C_TIMING);
+    while(num_bytes > 0)
+    {
+        /* Bytes remaining before the end of the current page, writing past this would roll over to the start of the page */
+        chunk = page_size - (byte_address & (page_size - 1));
 
-    i2c_read_blocking(i2c_instance, i2c_address, destination, num_bytes, false);
+        if(chunk > num_bytes)
+        {
+            chunk = num_bytes;
+        }
 
-    sleep_ms(I2C_TIMING);
+        result |= write_page(source, byte_address, chunk);
+
+        source       += chunk;
+        byte_address += chunk;
+        num_bytes    -= chunk;
+    }
+
+    return result;
 }
 
-/* Write a given single byte to the given address */
-int CAT24C32::write_byte(uint8_t byte, uint16_t byte_address)
+/* Writes up to one page in a single transaction, caller must ensure the data does not cross a page boundary.
+Returns 0 once the write cycle completes, 1 if the device NACKed the transfer or the write cycle timed out */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+int I2CEeprom<page_size, total_bytes, address_bytes>::write_page(uint8_t *source, uint16_t byte_address, uint8_t num_bytes)
 {
+    int written;
+
     /* Prepare address bytes */
-    command_buffer[0] = (uint8_t) (byte_address >> 8);
-    command_buffer[1] = (uint8_t) byte_address;
+    load_address(command_buffer, byte_address);
 
-    command_buffer[2] = byte;
+    /* Copy the data to be written into the buffer after the address bytes */
+    memcpy(&command_buffer[address_bytes], source, num_bytes);
 
-    i2c_write_blocking(i2c_instance, i2c_address, command_buffer, 3, false);
-    sleep_ms(I2C_TIMING);
+    write_cycle_address = device_address(byte_address);
+    written = i2c_write_blocking(i2c_instance, write_cycle_address, command_buffer, num_bytes + address_bytes, false);
 
-    /* Readback and compare */
-    command_buffer[3] = read_byte(byte_address);
+    /* A transfer NACKed part way through may still have started a write cycle, so wait it out before reporting the failure */
+    if(wait_for_write_cycle() || (written != (num_bytes + address_bytes)))
+    {
+        return 1;
+    }
+    return 0;
+}
+
+/* Blocks until the write cycle started by the last write completes.
+Returns 0 once the device is ready, 1 on timeout */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+int I2CEeprom<page_size, total_bytes, address_bytes>::wait_for_write_cycle(void)
+{
+    TRANSFER_STATUS status;
+
+    write_cycle_start_us = time_us_64();
+
+    do
+    {
+        status = poll_write_cycle();
+    } while(status == TRANSFER_BUSY);
+
+    return (status == TRANSFER_DONE) ? 0 : 1;
+}
+
+/* The device does not acknowledge its address while an internal write cycle is in progress,
+so probe the block last written once with a single byte read. Gives up after EEPROM_WRITE_TIMEOUT_US */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+TRANSFER_STATUS I2CEeprom<page_size, total_bytes, address_bytes>::poll_write_cycle(void)
+{
+    uint8_t dummy;
+    uint32_t elapsed;
+
+    if(i2c_read_blocking(i2c_instance, write_cycle_address, &dummy, 1, false) < 0)
+    {
+        if((time_us_64() - write_cycle_start_us) > EEPROM_WRITE_TIMEOUT_US)
+        {
+            write_timeouts++;
+            return TRANSFER_ERROR;
+        }
+        return TRANSFER_BUSY;
+    }
+
+    elapsed = (uint32_t)(time_us_64() - write_cycle_start_us);
+
+    last_write_time_us = elapsed;
+    if(elapsed > max_write_time_us)
+    {
+        max_write_time_us = elapsed;
+    }
+    write_count++;
+
+    return TRANSFER_DONE;
+}
+
+/* Uncapped read function, must pass a pointer to an array 
+big enough to hold the requested number of bytes.
+Returns 0 on success, 1 if the device NACKed either the address or the read */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+int I2CEeprom<page_size, total_bytes, address_bytes>::read_multiple_bytes(uint16_t byte_address, uint32_t num_bytes, uint8_t *destination)
+{
+    load_address(command_buffer, byte_address);
+
+    if(i2c_write_blocking(i2c_instance, device_address(byte_address), command_buffer, address_bytes, false) != address_bytes)
+    {
+        return 1;
+    }
 
-    return memcmp(&command_buffer[2], &command_buffer[3], 1);
+    if(i2c_read_blocking(i2c_instance, device_address(byte_address), destination, num_bytes, false) != (int)num_bytes)
+    {
+        return 1;
+    }
+    return 0;
 }
 
-/* Reads a single byte at the given address and returns it */
-uint8_t CAT24C32::read_byte(uint16_t byte_address)
+/* Write a given single byte to the given address.
+Returns 0 once the byte reads back, 1 if the write was NACKed, timed out or failed verification */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+int I2CEeprom<page_size, total_bytes, address_bytes>::write_byte(uint8_t byte, uint16_t byte_address)
 {
-    uint8_t read_byte;
+    int written;
+    uint8_t readback;
 
     /* Prepare address bytes */
-    command_buffer[0] = (uint8_t) (byte_address >> 8);
-    command_buffer[1] = (uint8_t) byte_address;
+    load_address(command_buffer, byte_address);
+
+    command_buffer[address_bytes] = byte;
+
+    write_cycle_address = device_address(byte_address);
+    written = i2c_write_blocking(i2c_instance, write_cycle_address, command_buffer, address_bytes + 1, false);
+
+    /* As write_page(), wait out any write cycle the transfer started before reporting a NACK */
+    if(wait_for_write_cycle() || (written != (address_bytes + 1)))
+    {
+        return 1;
+    }
+
+    /* Readback and compare */
+    if(read_byte(byte_address, &readback))
+    {
+        return 1;
+    }
+    return (readback != byte);
+}
 
-    /* Set the EEPROM internal address register by writing the 2 address bytes */
-    i2c_write_blocking(i2c_instance, i2c_address, command_buffer, 2, false);
-    sleep_ms(I2C_TIMING);
+/* Reads a single byte at the given address into destination.
+Returns 0 on success, 1 if the device NACKed either the address or the read */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+int I2CEeprom<page_size, total_bytes, address_bytes>::read_byte(uint16_t byte_address, uint8_t *destination)
+{
+    /* Prepare address bytes */
+    load_address(command_buffer, byte_address);
 
-    i2c_read_blocking(i2c_instance, i2c_address, &read_byte, 1, false);
+    /* Set the EEPROM internal address register by writing the address bytes */
+    if(i2c_write_blocking(i2c_instance, device_address(byte_address), command_buffer, address_bytes, false) != address_bytes)
+    {
+        return 1;
+    }
 
-    return read_byte;
+    if(i2c_read_blocking(i2c_instance, device_address(byte_address), destination, 1, false) != 1)
+    {
+        return 1;
+    }
+    return 0;
 }
 
-void CAT24C32::erase(void)
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+void I2CEeprom<page_size, total_bytes, address_bytes>::erase(void)
 {
     uint16_t address = 0;
-    uint8_t erase_buffer[CAT24C32_PAGE_SIZE];
+    uint8_t erase_buffer[page_size];
 
-    memset(erase_buffer, 0, CAT24C32_PAGE_SIZE);
+    memset(erase_buffer, 0, page_size);
 
-    for(int i = 0; i < CAT24C32_PAGE_COUNT; i++)
+    for(uint32_t i = 0; i < PAGE_COUNT; i++)
     {
-        write_multiple_bytes(erase_buffer, address, CAT24C32_PAGE_SIZE);
-        address+= CAT24C32_PAGE_SIZE;
+        write_multiple_bytes(erase_buffer, address, page_size);
+        address+= page_size;
     }
-}
\ No newline at end of file
+}
+
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+uint32_t I2CEeprom<page_size, total_bytes, address_bytes>::get_last_write_time_us(void)
+{
+    return last_write_time_us;
+}
+
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+uint32_t I2CEeprom<page_size, total_bytes, address_bytes>::get_max_write_time_us(void)
+{
+    return max_write_time_us;
+}
+
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+uint32_t I2CEeprom<page_size, total_bytes, address_bytes>::get_write_count(void)
+{
+    return write_count;
+}
+
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+uint32_t I2CEeprom<page_size, total_bytes, address_bytes>::get_write_timeouts(void)
+{
+    return write_timeouts;
+}
+
+/* Claims the DMA channels on first use and points the I2C block at its DMA handshakes */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+void I2CEeprom<page_size, total_bytes, address_bytes>::init_dma(void)
+{
+    i2c_hw_t *hw = i2c_get_hw(i2c_instance);
+
+    if(dma_tx_channel < 0)
+    {
+        dma_tx_channel   = dma_claim_unused_channel(true);
+        dma_stop_channel = dma_claim_unused_channel(true);
+        dma_rx_channel   = dma_claim_unused_channel(true);
+    }
+
+    dma_read_command = I2C_IC_DATA_CMD_CMD_BITS;
+    dma_stop_command = I2C_IC_DATA_CMD_CMD_BITS | I2C_IC_DATA_CMD_STOP_BITS;
+
+    /* Request TX data while the FIFO is at most half full, RX data as soon as a byte arrives */
+    hw->dma_tdlr = 8;
+    hw->dma_rdlr = 0;
+    hw->dma_cr   = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
+}
+
+/* The target address can only be changed while the block is disabled, as the SDK does for every blocking transfer */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+void I2CEeprom<page_size, total_bytes, address_bytes>::set_target(uint8_t target)
+{
+    i2c_hw_t *hw = i2c_get_hw(i2c_instance);
+
+    hw->enable = 0;
+    hw->tar    = target;
+    hw->enable = 1;
+}
+
+/****************************************************************
+Function:   start_read_dma
+Arguments:  (uint16_t) byte_address
+            (uint32_t) num_bytes (minimum 3)
+            (uint8_t*) destination
+Return:     bool (false if a transfer is already in flight)
+
+Starts a sequential read paced by the I2C DREQs. The address bytes
+and first read command go straight into the empty TX FIFO, one 
+channel then repeats a read command for every byte but the last, 
+and chains to a second channel which issues the final read with 
+STOP. A third channel drains the RX FIFO into destination.
+****************************************************************/
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+bool I2CEeprom<page_size, total_bytes, address_bytes>::start_read_dma(uint16_t byte_address, uint32_t num_bytes, uint8_t *destination)
+{
+    i2c_hw_t *hw = i2c_get_hw(i2c_instance);
+    dma_channel_config config;
+
+    if(transfer_active || (num_bytes < 3) || ((byte_address + num_bytes) > total_bytes))
+    {
+        return false;
+    }
+
+    init_dma();
+    set_target(device_address(byte_address));
+
+    /* RX: data_cmd -> destination */
+    config = dma_channel_get_default_config(dma_rx_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_8);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, true);
+    channel_config_set_dreq(&config, i2c_get_dreq(i2c_instance, false));
+    dma_channel_configure(dma_rx_channel, &config, destination, &hw->data_cmd, num_bytes, false);
+
+    /* Final read command with STOP, triggered by the TX channel completing */
+    config = dma_channel_get_default_config(dma_stop_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, i2c_get_dreq(i2c_instance, true));
+    dma_channel_configure(dma_stop_channel, &config, &hw->data_cmd, &dma_stop_command, 1, false);
+
+    /* The same read command repeated for the bytes between the first and the last */
+    config = dma_channel_get_default_config(dma_tx_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, false);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, i2c_get_dreq(i2c_instance, true));
+    channel_config_set_chain_to(&config, dma_stop_channel);
+    dma_channel_configure(dma_tx_channel, &config, &hw->data_cmd, &dma_read_command, num_bytes - 2, false);
+
+    if constexpr(address_bytes == 2)
+    {
+        hw->data_cmd = (uint8_t)(byte_address >> 8);
+    }
+    hw->data_cmd = (uint8_t)byte_address;
+    hw->data_cmd = I2C_IC_DATA_CMD_CMD_BITS | I2C_IC_DATA_CMD_RESTART_BITS;
+
+    transfer_active   = true;
+    transfer_is_write = false;
+
+    dma_channel_start(dma_rx_channel);
+    dma_channel_start(dma_tx_channel);
+
+    return true;
+}
+
+/****************************************************************
+Function:   start_page_write_dma
+Arguments:  (uint8_t*) source
+            (uint16_t) byte_address
+            (uint8_t)  num_bytes
+Return:     bool (false if a transfer is already in flight)
+
+Starts a single page write paced by the I2C TX DREQ. The data is 
+copied into the command buffer so the source may change while the
+transfer is in flight. As with write_page(), the caller must keep 
+the data within one page. Once poll_transfer() reports 
+TRANSFER_DONE the write cycle is in progress and can be polled with
+poll_write_cycle().
+****************************************************************/
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+bool I2CEeprom<page_size, total_bytes, address_bytes>::start_page_write_dma(uint8_t *source, uint16_t byte_address, uint8_t num_bytes)
+{
+    i2c_hw_t *hw = i2c_get_hw(i2c_instance);
+    dma_channel_config config;
+
+    if(transfer_active || (num_bytes == 0) || (num_bytes > page_size))
+    {
+        return false;
+    }
+
+    init_dma();
+    write_cycle_address = device_address(byte_address);
+    set_target(write_cycle_address);
+
+    load_address(command_buffer, byte_address);
+
+    for(uint8_t i = 0; i < address_bytes; i++)
+    {
+        dma_command_buffer[i] = command_buffer[i];
+    }
+
+    for(uint8_t i = 0; i < num_bytes; i++)
+    {
+        dma_command_buffer[i + address_bytes] = source[i];
+    }
+    dma_command_buffer[num_bytes + address_bytes - 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+
+    config = dma_channel_get_default_config(dma_tx_channel);
+    channel_config_set_transfer_data_size(&config, DMA_SIZE_32);
+    channel_config_set_read_increment(&config, true);
+    channel_config_set_write_increment(&config, false);
+    channel_config_set_dreq(&config, i2c_get_dreq(i2c_instance, true));
+
+    transfer_active   = true;
+    transfer_is_write = true;
+
+    dma_channel_configure(dma_tx_channel, &config, &hw->data_cmd, dma_command_buffer, num_bytes + address_bytes, true);
+
+    return true;
+}
+
+/* Reports the state of the DMA transfer in flight, a NACK from the device aborts the transfer */
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+TRANSFER_STATUS I2CEeprom<page_size, total_bytes, address_bytes>::poll_transfer(void)
+{
+    i2c_hw_t *hw = i2c_get_hw(i2c_instance);
+
+    if(!transfer_active)
+    {
+        return TRANSFER_IDLE;
+    }
+
+    if(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS)
+    {
+        dma_channel_abort(dma_tx_channel);
+        dma_channel_abort(dma_stop_channel);
+        dma_channel_abort(dma_rx_channel);
+        (void)hw->clr_tx_abrt;
+
+        transfer_active = false;
+        return TRANSFER_ERROR;
+    }
+
+    if(dma_channel_is_busy(dma_tx_channel) || dma_channel_is_busy(dma_stop_channel) || dma_channel_is_busy(dma_rx_channel))
+    {
+        return TRANSFER_BUSY;
+    }
+
+    /* Channels are finished once the last command is queued, the bus is done once the FIFO drains and the STOP goes out */
+    if(!(hw->status & I2C_IC_STATUS_TFE_BITS) || (hw->status & I2C_IC_STATUS_MST_ACTIVITY_BITS))
+    {
+        return TRANSFER_BUSY;
+    }
+
+    transfer_active = false;
+
+    if(transfer_is_write)
+    {
+        write_cycle_start_us = time_us_64();
+    }
+    return TRANSFER_DONE;
+}
+
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+TRANSFER_STATUS I2CEeprom<page_size, total_bytes, address_bytes>::wait_for_transfer(void)
+{
+    TRANSFER_STATUS status;
+
+    do
+    {
+        status = poll_transfer();
+    } while(status == TRANSFER_BUSY);
+
+    return status;
+}
+
+/* Parts in use, see the aliases in CAT24C32.h */
+template class I2CEeprom<32, 4096, 2>;
+template class I2CEeprom<64, 32768, 2>;
+template class I2CEeprom<128, 65536, 2>;
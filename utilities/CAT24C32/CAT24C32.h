@@ -6,36 +6,109 @@
 /* Pico SDK Includes */
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
+#include "hardware/dma.h"
 
-#define CAT24C32_PAGE_SIZE   32
-#define CAT24C32_PAGE_COUNT  128
-#define CAT24C32_TOTAL_BYTES 4096
-#define I2C_TIMING 5
+/* Upper bound on ACK polling after a write, the datasheet maximum write cycle time is 5ms */
+#define EEPROM_WRITE_TIMEOUT_US 10000
 
-class CAT24C32
+/* Status of a DMA transfer or write cycle, returned by the poll functions */
+typedef enum transfer_status
 {
+    TRANSFER_IDLE,
+    TRANSFER_BUSY,
+    TRANSFER_DONE,
+    TRANSFER_ERROR
+} TRANSFER_STATUS;
+
+/****************************************************************
+I2C EEPROM driver for the 24Cxx family. The geometry of the part
+is fixed at compile time so page splitting and bounds checks fold
+to constants. Parts with one address byte take the upper address 
+bits as block select bits in the device address.
+
+Member definitions live in CAT24C32.cpp, which explicitly 
+instantiates the parts aliased below - add the alias and an 
+instantiation there to use another part.
+****************************************************************/
+template <uint16_t page_size, uint32_t total_bytes, uint8_t address_bytes>
+class I2CEeprom
+{
+    public:
+        static constexpr uint16_t PAGE_SIZE     = page_size;
+        static constexpr uint32_t TOTAL_BYTES   = total_bytes;
+        static constexpr uint32_t PAGE_COUNT    = total_bytes / page_size;
+        static constexpr uint8_t  ADDRESS_BYTES = address_bytes;
+
+        static_assert((address_bytes == 1) || (address_bytes == 2), "24Cxx parts take one or two address bytes");
+        static_assert((page_size != 0) && ((page_size & (page_size - 1)) == 0), "Page size must be a power of two");
+        static_assert(page_size <= 255, "Page writes take a uint8_t length");
+        static_assert((total_bytes % page_size) == 0, "Capacity must be a whole number of pages");
+        static_assert(total_bytes <= ((address_bytes == 2) ? 0x10000UL : 0x800UL), "Capacity is beyond the reach of the address bytes and block select bits");
+
     private:
         i2c_inst_t *i2c_instance;
         uint8_t i2c_address;
 
-        /* Buffer for constructing write commands, 2 Address bytes + 32 Data bytes */
-        uint8_t command_buffer[CAT24C32_PAGE_SIZE + 2];
-        
+        /* Buffer for constructing write commands, address bytes + one page of data */
+        uint8_t command_buffer[page_size + address_bytes];
+
+        /* Write cycle statistics gathered by ACK polling */
+        uint32_t last_write_time_us = 0;
+        uint32_t max_write_time_us = 0;
+        uint32_t write_count = 0;
+        uint32_t write_timeouts = 0;
+        uint64_t write_cycle_start_us = 0;
+
+        /* Device address the last write went to, which is the block that ACK polling must probe */
+        uint8_t write_cycle_address = 0;
+
+        /* DMA: command words fed to the I2C TX FIFO, and the channels which move them */
+        uint32_t dma_command_buffer[page_size + address_bytes];
+        uint32_t dma_read_command;
+        uint32_t dma_stop_command;
+        int dma_tx_channel = -1;
+        int dma_stop_channel = -1;
+        int dma_rx_channel = -1;
+        bool transfer_active = false;
+        bool transfer_is_write = false;
+
+        uint8_t load_address(uint8_t *buffer, uint16_t byte_address);
+        uint8_t device_address(uint16_t byte_address);
+        int wait_for_write_cycle(void);
+        void init_dma(void);
+        void set_target(uint8_t target);
+
     public:
-        CAT24C32(){};
-        CAT24C32(i2c_inst_t *i2c_instance, uint8_t i2c_address); //TODO: Page size/page count/total bytes in constructor?
+        I2CEeprom(){};
+        I2CEeprom(i2c_inst_t *i2c_instance, uint8_t i2c_address);
 
-        void write_multiple_bytes(uint8_t *source, uint16_t byte_address, uint16_t num_bytes);
-        void read_multiple_bytes(uint16_t byte_address, uint16_t num_bytes, uint8_t *destination);
+        int write_multiple_bytes(uint8_t *source, uint16_t byte_address, uint32_t num_bytes);
+        int write_page(uint8_t *source, uint16_t byte_address, uint8_t num_bytes);
+        int read_multiple_bytes(uint16_t byte_address, uint32_t num_bytes, uint8_t *destination);
 
         int write_byte(uint8_t byte, uint16_t byte_address);
-        uint8_t read_byte(uint16_t byte_address);
+        int read_byte(uint16_t byte_address, uint8_t *destination);
 
         void erase(void);
 
+        /* Non-blocking bulk transfers, completion is checked with poll_transfer() */
+        bool start_read_dma(uint16_t byte_address, uint32_t num_bytes, uint8_t *destination);
+        bool start_page_write_dma(uint8_t *source, uint16_t byte_address, uint8_t num_bytes);
+        TRANSFER_STATUS poll_transfer(void);
+        TRANSFER_STATUS wait_for_transfer(void);
+        TRANSFER_STATUS poll_write_cycle(void);
+
+        uint32_t get_last_write_time_us(void);
+        uint32_t get_max_write_time_us(void);
+        uint32_t get_write_count(void);
+        uint32_t get_write_timeouts(void);
+
         void test(void);
 };
 
-#endif
+/* Supported parts */
+using CAT24C32  = I2CEeprom<32, 4096, 2>;
+using CAT24C256 = I2CEeprom<64, 32768, 2>;
+using CAT24C512 = I2CEeprom<128, 65536, 2>;
 
-//TODO: For later... page counter to increment pages?
\ No newline at end of file
+#endif